@@ -48,6 +48,7 @@ int d2_allocate_sph_protein(sph *p_data_sph,
 
   p_data_sph->dim = d;  
   p_data_sph->str = stride;
+  p_data_sph->max_str = stride;
   p_data_sph->col = 0;
 
 
@@ -57,12 +58,14 @@ int d2_allocate_sph_protein(sph *p_data_sph,
 
 
   p_data_sph->p_supp_sym = _D2_MALLOC_INT(n);
+  p_data_sph->p_supp = NULL;
 
   p_data_sph->vocab_size = PROTEIN_VOCAB_SIZE; // 20 types of amino acids
 
   p_data_sph->metric_type = D2_N_GRAM;
 
   p_data_sph->is_meta_allocated = false;
+  p_data_sph->hist_power = 0;
   return 0;
 }
 
@@ -146,6 +149,7 @@ int d2_read_sph_protein(const char* filename, sph *p_data_sph, mph *p_data) {
 
     p_data_sph->p_str[i] = str; 
     p_data_sph->col += str;
+    if (str > p_data_sph->max_str) p_data_sph->max_str = str;
 
     for (n=0; n<str; ++n) { // re-normalize
       p_data_sph->p_w[p_data_sph->p_str_cum[i] + n] /= w_sum;
@@ -387,6 +391,9 @@ int main(int argc, char *argv[]) {
   ad_hoc_op_badmm.maxIters = 60; 
   ad_hoc_op_badmm.rhoCoeff = 1.f; 
   ad_hoc_op_badmm.updatePerLoops = 60;
+  ad_hoc_op_badmm.tol = 0;
+  ad_hoc_op_badmm.rhoFactor = 1;
+  ad_hoc_op_badmm.sparseTol = 0;
   GRADDEC_options ad_hoc_op_graddec;
   ad_hoc_op_graddec.maxIters = 5;
   ad_hoc_op_graddec.stepSize = 0.5;
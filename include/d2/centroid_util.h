@@ -39,6 +39,53 @@ inline void minimize_symbolic(int d, int m, int *supp, const SCALAR *z, const in
 
 void calculate_distmat(sph *data_ph, int* label, size_t size, sph *c, SCALAR* C);
 
+/**
+ * Sparse counterparts of accumulate_symbolic() and minimize_symbolic() for
+ * D2_N_GRAM with many symbols, where most of z are zeros. An entry adds
+ * @param(val) to z[key] of the z of all labels (vocab_size x d x m per
+ * label), i.e. the symbol key % vocab_size at the support key / vocab_size.
+ */
+typedef struct {
+  size_t key;
+  SCALAR val;
+} symbolic_entry;
+
+/**
+ * Accumulate Z (m x p_str[i]) of the objects @param(member) of a label by
+ * accumulate_symbolic() into @param(z) of zeros (vocab_size x d x m), and
+ * append its non-zeros to @param(entries) in ascending order of keys offset
+ * by @param(offset), resetting them in z. @param(touched) is a buffer of
+ * d x m x vocab_size. Returns the number of appended entries.
+ */
+size_t accumulate_symbolic_sparse(sph *data_ph, const PLAN_SCALAR *Z, int m,
+				  const size_t *member, size_t count, size_t offset,
+				  SCALAR *z, int *touched, __OUT__ symbolic_entry *entries);
+
+/* sort @param(entries) by keys and sum up those of the same key, returning their number */
+size_t reduce_symbolic(size_t count, symbolic_entry *entries);
+
+/**
+ * minimize_symbolic() of the supports that have entries, which are sorted
+ * by keys, where only the columns of dist_mat of their symbols are summed
+ * up. @param(supp) is indexed by key / vocab_size, and other supports are
+ * kept as they are.
+ */
+void minimize_symbolic_sparse(size_t count, const symbolic_entry *entries, int vocab_size,
+			      const SCALAR *dist_mat, int *supp, SCALAR *z_buffer);
+
+#ifdef __USE_MPI__
+/**
+ * Sum up the sorted @param(entries) of all nodes by ranges of keys: each node
+ * receives the entries of its own @param(slot_counts) supports starting at
+ * @param(slot_displs) (key / vocab_size), which are set for nprocs nodes and
+ * cover all @param(num_of_slots) supports. Returns its merged entries, newly
+ * allocated, and their number in @param(count).
+ */
+symbolic_entry* reduce_scatter_symbolic(size_t *count, const symbolic_entry *entries,
+					size_t num_of_slots, int vocab_size,
+					__OUT__ int *slot_counts, __OUT__ int *slot_displs);
+#endif
+
 
 
 inline void broadcast_centroids(mph *centroids, int i) {
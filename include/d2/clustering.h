@@ -7,6 +7,7 @@ extern "C" {
 
 #include "utils/common.h"
 #include "d2/param.h"
+#include "d2/solver.h"
 
   /**
    * data structure to store d2 dataset of one phase
@@ -40,7 +41,8 @@ extern "C" {
      *
      * what: metric space of supports 
      * @param(metric_type)
-     * D2_EUCLIDEAN_L2 : Euclidean space at @param(p_supp,p_w)
+     * D2_EUCLIDEAN_L2 : Euclidean space at @param(p_supp,p_w), where supports
+     *                   of each d2 are sorted ascendingly after read if dim = 1
      * D2_WORD_EMBED   : Word embedding space (Euclidean)
      * D2_CITYBLOCK_L1 : cityblock metric space @param(p_supp,p_w) => to be implemented
      * D2_HISTOGRAM    : Histogram space at @param(p_w,dist_mat)
@@ -88,6 +90,14 @@ extern "C" {
     int vocab_size;
     SCALAR *vocab_vec;
 
+    /**
+     * Optional @param(hist_power, hist_scale):
+     * for data in D2_HISTOGRAM whose dist_mat(i,j) = hist_scale * |i-j|^hist_power
+     * with hist_power = 1 or 2, which is detected after read; otherwise
+     * hist_power = 0. Such distances and centroids have closed forms. */
+    int hist_power;
+    SCALAR hist_scale;
+
     /**
      * Optional @param(is_meta_allocated): 
      * tag to indicate whether vocab_vec or dist_mat is newly allocated */
@@ -102,6 +112,11 @@ extern "C" {
     Comments 2015-07-13
     @param(l,u,s) the meaning for each symbol has been consistent with what has
     been described in Elkan's original paper. 
+
+    @param(num_of_bounds) is the number of lower bounds per object: either
+    the number of labels (Elkan), the number of groups of centroids
+    (Yinyang) given by @param(group), or 1 (Hamerly), so that they fit the
+    memory budget, see d2_labeling_prep().
    */
   typedef struct {
     SCALAR *l; /* lower bound of distance pair */
@@ -109,6 +124,9 @@ extern "C" {
     SCALAR *s; 
     SCALAR *c; /* distance between centroids */
     char *r;    
+    int num_of_bounds;
+    int *group; /* group of each centroid for Yinyang's bounds, or NULL */
+    SCALAR *drift; /* drifts of centroids since their rows of c were computed, negative before */
   } trieq;
 
   /**
@@ -142,6 +160,8 @@ extern "C" {
 		  const int *type_of_phases);
 
   int d2_read(const char* filename, const char* meta_filename, __OUT__ mph *p_data);
+  FILE* d2_open(const char* filename, const char* meta_filename, __OUT__ mph *p_data);
+  int d2_read_next(FILE *fp, __OUT__ mph *p_data);
   int d2_write(const char* filename, mph *p_data);
   int d2_write_labels(const char* filename, mph *p_data);
   int d2_write_labels_serial(const char* filename_ind, const char* filename, mph *p_data);
@@ -163,6 +183,16 @@ extern "C" {
 		    char use_triangle,
 		    const char* log_file);  
 
+  /* mini-batch algorithm on d2 streamed from file by batches of p_batch->size */
+  int d2_clustering_minibatch(int k,
+			      int max_iter,
+			      const char* filename,
+			      const char* meta_filename,
+			      mph *p_batch,
+			      __OUT__ mph *centroids,
+			      int selected_phase,
+			      const char* log_file);
+
   int d2_assignment(int k,
 		    mph *p_data, 
 		    mph *centroids, 
@@ -177,15 +207,20 @@ extern "C" {
     SCALAR *C;
     SCALAR *X;
     SCALAR *L;
+    SCALAR *C_batch; /* cost matrices of a chunk of batched problems per thread, may be NULL */
+    d2_match_problem *batch; /* problems of a chunk in order, one chunk per thread */
+    size_t batch_stride;
+    SCALAR *mean; /* weighted means of supports of objects followed by centroids, may be NULL */
   } var_sph;
 
   /**
    * working variables specific to Bregman ADMM
    */
   typedef struct {
-    SCALAR *X, *Z;
-    SCALAR *Y;
+    PLAN_SCALAR *X, *Z;
+    PLAN_SCALAR *Y;
     SCALAR *Xc, *Zr;
+    PLAN_SCALAR *C; /* normalized costs of plans if PLAN_SCALAR is not SCALAR, or NULL for var_sph C */
   } var_sphBregman;
 
   /**
@@ -197,8 +232,28 @@ extern "C" {
     var_sphBregman *l_var_sphBregman; // may not initialized, which depends on the actual centroid algorithm used.    
     char *label_switch;
     trieq tr; /* data structure for relabeling */
+    int num_of_threads;
+    d2_solver_context **solver_ctx; /* one solver context per thread */
+    size_t batch_size; /* problems of a chunk, batch and batch_val hold one chunk per thread */
+    size_t num_of_labels; /* batch_idx and batch_dist hold num_of_labels entries per thread */
+    d2_match_problem *batch; /* a chunk of at most batch_size problems */
+    size_t *batch_idx;
+    double *batch_val, *batch_dist; /* costs, lower bounds (and prior bounds) of a batch */
   } var_mph; 
 
+  /* weighted means of supports of the first size d2 in a phase */
+  void d2_compute_means(sph *p_sph, size_t size, __OUT__ SCALAR *mean);
+
+  /* sort supports of a d2 in a 1-D phase, see D2_EUCLIDEAN_L2 */
+  char d2_sort_supports_1d(int n, SCALAR *supp, SCALAR *w, __OUT__ int *perm);
+
+  /* solver context of the calling thread */
+  d2_solver_context* d2_get_solver_context(var_mph *var_work);
+
+  /* view of var_work for the calling thread in a parallel region, see d2_labeling() */
+  void d2_thread_work(var_mph *var_work, int selected_phase,
+		      var_sph *g_var, __OUT__ var_mph *thread_work);
+
   int d2_allocate_work(mph *p_data, var_mph *var_work, char use_triangle, int selected_phase);
   int d2_free_work(var_mph *var_work, int selected_phase);
   
@@ -216,6 +271,16 @@ extern "C" {
   int d2_centroid_rands(mph *p_data, 
 			int idx_ph, 
 			__OUT__ sph *c);
+
+  /**
+   * interface of centroids from given objects, see d2_init_rounds for
+   * k-means|| seeding
+   */
+  int d2_centroid_sample(mph *p_data,
+			 int idx_ph,
+			 const size_t *samples,
+			 size_t count,
+			 __OUT__ sph *c);
   
   /**
    * interface of Bregman ADMM
@@ -230,6 +295,14 @@ extern "C" {
 			     __OUT__ sph *c);
 
 
+  /**
+   * interface of closed-form centroids of D2_HISTOGRAM with hist_power > 0
+   */
+  int d2_centroid_sphQuantile(mph *p_data,
+			      int idx_ph,
+			      sph *c0,
+			      __OUT__ sph *c);
+
   /**
    * interfaces of Gradient Decent and ADMM (for experimental purpose only, deprecated)
    */
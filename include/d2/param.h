@@ -5,6 +5,9 @@ typedef struct {
   int maxIters;
   double rhoCoeff;
   int updatePerLoops;
+  double tol; /* tolerance of residuals per object, 0 to stop by time budget instead */
+  double rhoFactor; /* factor of residual balancing of rho, 1 to keep rho fixed */
+  double sparseTol; /* entries of plans below it times their marginals are skipped, 0 to keep plans dense */
 } BADMM_options;
 
 
@@ -14,11 +17,23 @@ typedef struct {
 } GRADDEC_options;
 
 
+typedef struct {
+  int maxIters;
+  double regCoeff; /* entropic regularization relative to the mean of costs */
+  double tol;      /* tolerance of marginal violation */
+} SINKHORN_options;
+
+
 #define D2_CENTROID_BADMM    (0)
 #define D2_CENTROID_ADMM     (1)
 #define D2_CENTROID_GRADDEC  (2)
 
 
+/* engines to compute distances in labeling */
+#define D2_DISTANCE_EXACT    (0)
+#define D2_DISTANCE_SINKHORN (1)
+
+
 /* types of D2 data */
 #define D2_EUCLIDEAN_L2      (0)
 #define D2_CITYBLOCK_L1      (1)
@@ -7,6 +7,13 @@ extern "C" {
 
 #include "utils/common.h"
 
+  /**
+   * Returned by d2_match_by_distmat*() and d2_match_by_distmat_qp() instead
+   * of a cost when the problem is not solved, e.g. the network simplex
+   * reaches its maximum number of pivots, or the solver does not support it.
+   */
+#define D2_SOLVER_ERROR (-1.)
+
   void d2_solver_setup();
   void d2_solver_release();
   void d2_solver_debug();
@@ -14,9 +21,65 @@ extern "C" {
   double d2_match_by_distmat(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY, 
 			     /** OUT **/ SCALAR *x, /** OUT **/ SCALAR *lambda, size_t index);
 
+  /**
+   * A solver context owns the cached working space of the solver (e.g. the
+   * tasks of MOSEK). d2_match_by_distmat() runs on a process-wide default
+   * context, so threads solving concurrently should each create their own
+   * context after d2_solver_setup() and call d2_match_by_distmat_ctx().
+   */
+  typedef struct d2_solver_context d2_solver_context;
+  d2_solver_context* d2_solver_context_create();
+  void d2_solver_context_free(d2_solver_context *ctx);
+
+  /**
+   * Keep the optimal bases of at most @param(capacity) problems, least
+   * recently used ones dropped first, keyed by the @param(index) passed to
+   * d2_match_by_distmat_ctx(). A later solve of the same index and shape
+   * starts from that basis when it is still feasible, which takes a few
+   * pivots after a small move of the centroid. The capacity is 0 by default.
+   */
+  void d2_solver_context_warmstart(d2_solver_context *ctx, size_t capacity);
+
+  double d2_match_by_distmat_ctx(d2_solver_context *ctx,
+				 int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+				 /** OUT **/ SCALAR *x, /** OUT **/ SCALAR *lambda, size_t index);
+
+  /**
+   * One transportation problem of a batch, whose arguments follow those of
+   * d2_match_by_distmat().
+   */
+  typedef struct {
+    int n, m;
+    SCALAR *C, *wX, *wY;
+    size_t index;
+  } d2_match_problem;
+
+  /**
+   * Solve @param(count) problems in one call and write their costs to
+   * @param(fval). Problems of the same shape are solved in a row, and they
+   * are distributed over min(num_of_ctx, #threads) threads, each of which
+   * uses its own context of @param(ctx). Pass the context of the calling
+   * thread with num_of_ctx = 1 when it is called within a parallel region.
+   */
+  void d2_match_by_distmat_batch(d2_solver_context **ctx, int num_of_ctx,
+				 size_t count, d2_match_problem *problems,
+				 /** OUT **/ double *fval);
+
   double d2_match_by_distmat_qp(int n, int m, SCALAR *C, SCALAR *L, SCALAR rho, SCALAR *lw, SCALAR *rw, SCALAR *x0, /** OUT **/ SCALAR *x);
   
   double d2_qpsimple(int str, int count, SCALAR *q, /** OUT **/ SCALAR *w);
+
+  /* entropic approximation: returns an upper bound and writes a lower bound of the exact cost */
+  double d2_match_by_sinkhorn(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			      double reg, int max_iters, double tol,
+			      /** OUT **/ double *lower);
+
+  /**
+   * Exact cost between distributions on a line under |x - y|^p, with supports
+   * @param(x, y) sorted ascendingly, or the bins 0, 1, ... when NULL.
+   */
+  double d2_match_by_quantile(int n, int m, const SCALAR *x, const SCALAR *y,
+			      const SCALAR *wX, const SCALAR *wY, int p);
 #ifdef __cplusplus
 }
 #endif
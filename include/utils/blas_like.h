@@ -8,6 +8,13 @@ extern "C" {
 
   #include <stdlib.h>
 
+  /* kernels cloned for AVX-512/AVX2, one of which is picked at load time by the CPU */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define _D2_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define _D2_SIMD_CLONES
+#endif
+
   // assertation
   void _dgzero(size_t n, double *a); //assert (a>0)
 
@@ -16,6 +23,10 @@ extern "C" {
   void _dvmul(size_t n, double *a, double *b, double *c);// c = a .* b
   void _dexp(size_t n, double *a);//inplace a -> exp(a);
 
+  // fused op of Bregman ADMM
+  void _dcexpnorm(size_t m, size_t n, const double *z, const double *c, const double *y, const double *b, double eps, double *x); // x = z .* exp(-c-y) + eps; x(:,*) = x(:,*) / sum(x(:,*)) * b(*)
+  void _drexpnorm(size_t m, size_t n, const double *x, const double *y, const double *b, double eps, double *z, double *sa); // z = x .* exp(y) + eps; sa(*) = sum(z(*,:)); z(*,:) = z(*,:) / sa(*) * b(*)
+
   // column-wise op
   void _dgcmv(size_t m, size_t n, double *a, double *b); // a(:,*) = a(:,*) .+ b
   void _dgcms(size_t m, size_t n, double *a, double *b); // a = diag(b) * a
@@ -43,6 +54,9 @@ extern "C" {
    */
   void _dpdist2(int d, size_t n, size_t m, double * A, double * B, double *C);
   void _dpdist2_sym(int d, size_t n, size_t m, double *A, int *B, double *C, const double *vocab);
+  /* C + k*stride = pdist2(d, n, m, A[k], B) of count problems, see pdist2_batch() */
+  void _dpdist2_batch(int d, size_t n, size_t m, size_t count, double *const *A, double *B, double *C, size_t stride);
+  void _dpdist2_sym_batch(int d, size_t n, size_t m, size_t count, double *const *A, int *Bi, double *C, size_t stride, const double *vocab);
   void _dpdist2_submat(size_t m, int *Bi, double *C,
 		       const int vocab_size, const double *dist_mat);
   
@@ -58,6 +72,10 @@ extern "C" {
   void _svmul(size_t n, float *a, float *b, float *c);// c = a .* b
   void _sexp(size_t n, float *a);//inplace a -> exp(a);
 
+  // fused op of Bregman ADMM
+  void _scexpnorm(size_t m, size_t n, const float *z, const float *c, const float *y, const float *b, float eps, float *x); // x = z .* exp(-c-y) + eps; x(:,*) = x(:,*) / sum(x(:,*)) * b(*)
+  void _srexpnorm(size_t m, size_t n, const float *x, const float *y, const float *b, float eps, float *z, float *sa); // z = x .* exp(y) + eps; sa(*) = sum(z(*,:)); z(*,:) = z(*,:) / sa(*) * b(*)
+
   // column-wise op
   void _sgcmv(size_t m, size_t n, float *a, float *b); // a(:,*) = a(:,*) .+ b
   void _sgcms(size_t m, size_t n, float *a, float *b); // a = diag(b) * a
@@ -85,6 +103,9 @@ extern "C" {
    */
   void _spdist2(int d, size_t n, size_t m, float * A, float * B, float *C);
   void _spdist2_sym(int d, size_t n, size_t m, float *A, int *B, float *C, const float *vocab);
+  /* C + k*stride = pdist2(d, n, m, A[k], B) of count problems, see pdist2_batch() */
+  void _spdist2_batch(int d, size_t n, size_t m, size_t count, float *const *A, float *B, float *C, size_t stride);
+  void _spdist2_sym_batch(int d, size_t n, size_t m, size_t count, float *const *A, int *Bi, float *C, size_t stride, const float *vocab);
   void _spdist2_submat(size_t m, int *Bi, float *C,
 		       const int vocab_size, const float *dist_mat);
   void _spdist_symbolic(int d, size_t n, size_t m, int * A, int * B, float *C, 
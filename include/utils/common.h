@@ -70,6 +70,22 @@ extern "C" {
   //#define _D2_LAPACKE_FUNC(x) s ## x
 #endif
 
+  /**
+   * With _D2_MIXED, transport plans of Bregman ADMM and their costs are
+   * stored in float, while the rest, including reductions of plans into
+   * centroids, residuals and objectives, stays in double.
+   */
+#ifdef _D2_MIXED
+#ifndef _D2_DOUBLE
+#error "_D2_MIXED requires _D2_DOUBLE"
+#endif
+#define PLAN_SCALAR         float
+#define _D2_PLAN_FUNC(x)    _s ## x
+#else
+#define PLAN_SCALAR         SCALAR
+#define _D2_PLAN_FUNC(x)    _D2_FUNC(x)
+#endif
+
 #define BILLION  1000000000L
 
 // Timing, count in nano seconds.
@@ -0,0 +1,55 @@
+#ifndef _LRU_CACHE_HH_
+#define _LRU_CACHE_HH_
+
+#include <list>
+#include <map>
+#include <utility>
+
+/**
+ * A bounded map that drops the least recently used entry when it is full.
+ * It keeps nothing when the capacity is zero.
+ */
+template <typename K, typename V>
+class lru_cache {
+ public:
+  lru_cache(): capacity_(0) {}
+
+  void set_capacity(size_t capacity) {
+    capacity_ = capacity;
+    while (entries_.size() > capacity_) pop();
+  }
+
+  /* return the entry of key, or NULL if it is not cached */
+  V* find(const K &key) {
+    typename std::map<K, iterator>::iterator it = mapper_.find(key);
+    if (it == mapper_.end()) return NULL;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  /* return the entry of key to be written, or NULL if nothing is cached */
+  V* insert(const K &key) {
+    V *v = find(key);
+    if (v || capacity_ == 0) return v;
+    if (entries_.size() >= capacity_) pop();
+    entries_.push_front(std::make_pair(key, V()));
+    mapper_[key] = entries_.begin();
+    return &entries_.front().second;
+  }
+
+  void clear() {entries_.clear(); mapper_.clear();}
+
+ private:
+  typedef typename std::list< std::pair<K, V> >::iterator iterator;
+
+  void pop() {
+    mapper_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+
+  size_t capacity_;
+  std::list< std::pair<K, V> > entries_;
+  std::map<K, iterator> mapper_;
+};
+
+#endif /* _LRU_CACHE_HH_ */
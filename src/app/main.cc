@@ -22,6 +22,14 @@
  */
 #include "d2/param.h"
 extern int d2_alg_type;
+extern int d2_dist_type;
+extern SINKHORN_options *p_sinkhorn_options;
+extern size_t d2_warmstart_size;
+extern size_t d2_bound_budget;
+extern int d2_bound_groups;
+extern int d2_init_rounds;
+extern int d2_badmm_by_cluster;
+extern BADMM_options badmm_clu_options, badmm_cen_options;
 
 int main(int argc, char *argv[])
 { 
@@ -47,6 +55,7 @@ int main(int argc, char *argv[])
   int number_of_clusters = 3; 
   int max_iters = 100; 
   size_t num_of_batches = 0; // default not used, for prepare data only
+  long mini_batch_size = 0; // default not used, for mini-batch clustering only
 
   /* IO specification */
   int ch;
@@ -66,12 +75,22 @@ int main(int argc, char *argv[])
     {"types", 1, 0, 'E'},
     {"eval", 1, 0, 'e'},
     {"load", 1, 0, 'L'},
+    {"sinkhorn", 1, 0, 'S'},
+    {"warm_start", 1, 0, 'W'},
+    {"bound_budget", 1, 0, 'B'},
+    {"bound_groups", 1, 0, 'G'},
+    {"init_rounds", 1, 0, 'I'},
+    {"mini_batch", 1, 0, 'b'},
+    {"cluster_parallel", 0, 0, 'C'},
+    {"badmm_tol", 1, 0, 'r'},
+    {"badmm_rho_factor", 1, 0, 'F'},
+    {"badmm_sparse", 1, 0, 'R'},
     {NULL, 0, NULL, 0}
   };
 
   /* [BEGIN] Parsing program arguments */
   int option_index = 0;
-  while ( (ch = getopt_long(argc, argv, "p:n:s:i:o:D:d:t:k:m:M:TQP:E:e:L:", long_options, &option_index)) != -1) {
+  while ( (ch = getopt_long(argc, argv, "p:n:s:i:o:D:d:t:k:m:M:TQP:E:e:L:S:W:B:G:I:b:Cr:F:R:", long_options, &option_index)) != -1) {
     switch (ch) {
     case 'i': /* input filename */
       filename = optarg;
@@ -127,6 +146,42 @@ int main(int argc, char *argv[])
     case 'P':
       num_of_batches = atoi(optarg); assert(num_of_batches > 0);
       break;
+    case 'S': /* reg[,max_iters[,tol]] */
+      {
+	vector<string> sk = split(string(optarg), ',');
+	d2_dist_type = D2_DISTANCE_SINKHORN;
+	p_sinkhorn_options->regCoeff = atof(sk[0].c_str()); assert(p_sinkhorn_options->regCoeff > 0);
+	if (sk.size() > 1) {p_sinkhorn_options->maxIters = atoi(sk[1].c_str()); assert(p_sinkhorn_options->maxIters > 0);}
+	if (sk.size() > 2) p_sinkhorn_options->tol = atof(sk[2].c_str());
+      }
+      break;
+    case 'W':
+      d2_warmstart_size = atol(optarg);
+      break;
+    case 'B': /* in megabytes */
+      d2_bound_budget = (size_t) atol(optarg) << 20;
+      break;
+    case 'G':
+      d2_bound_groups = atoi(optarg);
+      break;
+    case 'I':
+      d2_init_rounds = atoi(optarg); assert(d2_init_rounds >= 0);
+      break;
+    case 'b': /* size of batches per processor */
+      mini_batch_size = atol(optarg); assert(mini_batch_size > 0);
+      break;
+    case 'C':
+      d2_badmm_by_cluster = true;
+      break;
+    case 'r':
+      badmm_clu_options.tol = badmm_cen_options.tol = atof(optarg); assert(badmm_clu_options.tol >= 0);
+      break;
+    case 'F':
+      badmm_clu_options.rhoFactor = badmm_cen_options.rhoFactor = atof(optarg); assert(badmm_clu_options.rhoFactor >= 1);
+      break;
+    case 'R':
+      badmm_clu_options.sparseTol = badmm_cen_options.sparseTol = atof(optarg); assert(badmm_clu_options.sparseTol >= 0);
+      break;
     default:
       printf ("?? getopt returned character code 0%o ??\n", ch);
       exit(0);
@@ -147,6 +202,8 @@ int main(int argc, char *argv[])
 	 && size_of_phases == (int) ss3.size()
 	 && ss2_c_str);
   assert((size_of_phases == 1 || !meta_filename));
+  assert(!mini_batch_size || (!is_eval && num_of_batches == 0 && !is_pre_processed));
+  if (mini_batch_size) size_of_samples = mini_batch_size;
 
   if (world_rank == 0) {cout << "Task: " << endl;}  
   for (int i=0; i<size_of_phases; ++i) {
@@ -182,7 +239,9 @@ int main(int argc, char *argv[])
 
   if (num_of_batches == 0 && is_pre_processed) num_of_batches = 1;
 
-  if (err == 0 && num_of_batches == 0) {  
+  if (err == 0 && mini_batch_size) {
+    // data is streamed by batches, see d2_clustering_minibatch()
+  } else if (err == 0 && num_of_batches == 0) {  
     d2_read(filename, meta_filename, &data);  
   } else if (num_of_batches > 0 && world_rank == 0) {
     d2_read(filename, meta_filename, &data);      
@@ -241,13 +300,23 @@ int main(int argc, char *argv[])
       }
     }
 
-    d2_clustering(number_of_clusters, 
-		  max_iters, 
-		  &data, 
-		  &c, 
-		  selected_phase,
-		  use_triangle,
-		  name_hashValue.c_str());
+    if (mini_batch_size) 
+      d2_clustering_minibatch(number_of_clusters,
+			      max_iters,
+			      filename,
+			      meta_filename,
+			      &data,
+			      &c,
+			      selected_phase,
+			      name_hashValue.c_str());
+    else
+      d2_clustering(number_of_clusters, 
+		    max_iters, 
+		    &data, 
+		    &c, 
+		    selected_phase,
+		    use_triangle,
+		    name_hashValue.c_str());
 
     if (world_rank == 0) {
       if (output_filename) name_hashValue = std::string(output_filename);
@@ -277,9 +346,11 @@ int main(int argc, char *argv[])
   }
 
   if (output_filename) name_hashValue = std::string(output_filename);
-  d2_write_labels((name_hashValue + ".label").c_str(), &data);
-  d2_write_labels_serial((std::string(filename) + ".ind").c_str(), 
-			 name_hashValue.c_str(), &data);
+  if (!mini_batch_size) { // labels of the last batch only otherwise
+    d2_write_labels((name_hashValue + ".label").c_str(), &data);
+    d2_write_labels_serial((std::string(filename) + ".ind").c_str(), 
+			   name_hashValue.c_str(), &data);
+  }
 
   d2_free(&data);
   d2_free(&c);
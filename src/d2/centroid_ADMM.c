@@ -13,7 +13,7 @@ int d2_centroid_sphADMM(mph *p_data,
 			sph *c0,
 			__OUT__ sph *c) {
   size_t i, j;
-  int iter, nIter = 5, admm, admmIter = 5;
+  int iter, nIter = 5, admm, admmIter = 5, failed;
   double fval0, fval = DBL_MAX;
   int *label = p_data->label;
   size_t num_of_labels = p_data->num_of_labels;
@@ -59,8 +59,12 @@ int d2_centroid_sphADMM(mph *p_data,
   for (iter = 0; iter <= nIter; ++iter) {
     fval0 = fval;
     fval = 0;
+    failed = 0;
 
     /* compute exact distances */
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:fval,failed)
+#endif
     for (i=0; i<size; ++i) {
       double val;
       _D2_FUNC(pdist2)(dim, 
@@ -69,14 +73,16 @@ int d2_centroid_sphADMM(mph *p_data,
 		       c->p_supp + label[i]*strxdim, 
 		       p_supp + p_str_cum[i]*dim, 
 		       C + str*p_str_cum[i]); 
-      val   = d2_match_by_distmat(str, p_str[i],
+      val   = d2_match_by_distmat_ctx(d2_get_solver_context(var_work),
+				  str, p_str[i],
 				  C + str*p_str_cum[i],
 				  c->p_w + label[i]*str, p_w + p_str_cum[i],
 				  X + p_str_cum[i]*str,
 				  L + i*str,
-				  i); // known bug as for only one phase
-      fval += val;
+				  i*num_of_labels + label[i]); // known bug as for only one phase
+      if (val == D2_SOLVER_ERROR) ++failed; else fval += val;
     }
+    if (failed) {printf("\t%d transportation problems are not solved\n", failed); break;}
     fval /= size;
     
 
@@ -115,15 +121,21 @@ int d2_centroid_sphADMM(mph *p_data,
     for (admm = 0; admm < admmIter; ++admm) {
       /* step 1, update X */
 
-      for (i=0; i < size; ++i) {
-	d2_match_by_distmat_qp(str, p_str[i], 
-			       C + p_str_cum[i]*str, 
-			       L + i*str,
-			       rho,
-			       c->p_w + label[i]*str, 
-			       p_w + p_str_cum[i], 
-			       X + p_str_cum[i]*str, 
-			       X + p_str_cum[i]*str);
+      for (i=0; i < size && !failed; ++i) {
+	failed = d2_match_by_distmat_qp(str, p_str[i], 
+					C + p_str_cum[i]*str, 
+					L + i*str,
+					rho,
+					c->p_w + label[i]*str, 
+					p_w + p_str_cum[i], 
+					X + p_str_cum[i]*str, 
+					X + p_str_cum[i]*str) == D2_SOLVER_ERROR;
+      }
+      if (failed) {
+	/* keep the supports updated above, but not weights */
+	printf("\tthe solver does not support QP, weights of centroids are not updated\n");
+	admmIter = 0;
+	break;
       }
 
       /* step 2, update c->p_w */
@@ -3,9 +3,15 @@
 #include "d2/param.h"
 #include "d2/centroid_util.h"
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <float.h>
 #include <assert.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #ifdef __USE_MPI__
 #include <mpi.h>
 #endif
@@ -14,22 +20,36 @@
 
 /* choose options */
 
-BADMM_options badmm_clu_options = {.maxIters = 100, .rhoCoeff = 2.f, .updatePerLoops = 10};
-BADMM_options badmm_cen_options = {.maxIters = 2000, .rhoCoeff = 1.f, .updatePerLoops = 10};
+BADMM_options badmm_clu_options = {.maxIters = 100, .rhoCoeff = 2.f, .updatePerLoops = 10, .tol = 0, .rhoFactor = 1, .sparseTol = 0};
+BADMM_options badmm_cen_options = {.maxIters = 2000, .rhoCoeff = 1.f, .updatePerLoops = 10, .tol = 0, .rhoFactor = 1, .sparseTol = 0};
 
 #define ROUNDOFF (1E-9)
 
+/* ratio of primal and dual residuals beyond which rho is rebalanced */
+#define RHO_BALANCE (3.)
+
+/* bytes of plans of objects in a tile that are iterated while in L2 cache */
+#define TILE_SIZE (1 << 18)
+
+#define _D2_MALLOC_PLAN(x) (PLAN_SCALAR *) malloc((x) * sizeof(PLAN_SCALAR))
+
 BADMM_options *p_badmm_options = &badmm_clu_options;
 
 extern double time_budget;
+extern double tol_scale;
+extern int d2_badmm_by_cluster;
  
 int d2_allocate_work_sphBregman(sph *ph, size_t size, var_sphBregman * var_phwork) {
   assert(ph->str > 0 && ph->col > 0 && size > 0);
-  var_phwork->X = _D2_MALLOC_SCALAR (ph->str * ph->col); assert(var_phwork->X);
-  var_phwork->Z = _D2_MALLOC_SCALAR (ph->str * ph->col); assert(var_phwork->Z);
+  var_phwork->X = _D2_MALLOC_PLAN   (ph->str * ph->col); assert(var_phwork->X);
+  var_phwork->Z = _D2_MALLOC_PLAN   (ph->str * ph->col); assert(var_phwork->Z);
   var_phwork->Xc= _D2_MALLOC_SCALAR (ph->col);           assert(var_phwork->Xc);
   var_phwork->Zr= _D2_MALLOC_SCALAR (ph->str * size);    assert(var_phwork->Zr);
-  var_phwork->Y = _D2_MALLOC_SCALAR (ph->str * ph->col); assert(var_phwork->Y); // initialized
+  var_phwork->Y = _D2_MALLOC_PLAN   (ph->str * ph->col); assert(var_phwork->Y); // initialized
+  var_phwork->C = NULL;
+  if (sizeof(PLAN_SCALAR) != sizeof(SCALAR)) {
+    var_phwork->C = _D2_MALLOC_PLAN (ph->str * ph->col); assert(var_phwork->C);
+  }
 
   return 0;
 }
@@ -40,9 +60,604 @@ int d2_free_work_sphBregman(var_sphBregman *var_phwork) {
   if (var_phwork->Y) _D2_FREE(var_phwork->Y);
   if (var_phwork->Xc)_D2_FREE(var_phwork->Xc);
   if (var_phwork->Zr)_D2_FREE(var_phwork->Zr);
+  if (var_phwork->C) _D2_FREE(var_phwork->C);
   return 0;
 }
 
+/**
+ * Keep supports of 1-D centroids in order, so that distances to them are
+ * merges of quantiles without sorting (see d2_match_by_quantile()). Rows
+ * of the @param(plans) of objects are permuted in the same way, which
+ * leaves the iterations unchanged, and the active entries of permuted
+ * objects are dropped by @param(nnz) = -1 if it is not NULL (see
+ * active_plans), so they are reselected by the next update.
+ */
+static void sort_centroids_1d(sph *data_ph, int *label, size_t size,
+			      sph *c, size_t num_of_labels,
+			      PLAN_SCALAR **plans, int num_of_plans, int *nnz) {
+  int str = c->str, *perm, k, t, p;
+  size_t i, l;
+  char *sorted;
+  PLAN_SCALAR *buffer;
+
+  perm = _D2_MALLOC_INT(str * num_of_labels);
+  sorted = (char *) malloc(num_of_labels);
+  for (l=0; l<num_of_labels; ++l)
+    sorted[l] = d2_sort_supports_1d(str, c->p_supp + l*str, c->p_w + l*str, perm + l*str);
+
+  buffer = _D2_MALLOC_PLAN(str);
+  for (i=0; i<size; ++i)
+    if (!sorted[label[i]]) {
+      int *perm_l = perm + label[i]*str;
+      if (nnz) nnz[i] = -1;
+      for (p=0; p<num_of_plans; ++p)
+	for (t=0; t<data_ph->p_str[i]; ++t) {
+	  PLAN_SCALAR *x = plans[p] + str*(data_ph->p_str_cum[i] + t);
+	  for (k=0; k<str; ++k) buffer[k] = x[perm_l[k]];
+	  for (k=0; k<str; ++k) x[k] = buffer[k];
+	}
+    }
+
+  _D2_FREE(buffer);
+  _D2_FREE(perm);
+  free(sorted);
+}
+
+/* @param(a) of n entries as PLAN_SCALAR, converted into @param(buffer) if needed */
+static PLAN_SCALAR* plan_view(size_t n, SCALAR *a, PLAN_SCALAR *buffer) {
+  size_t j;
+  if (sizeof(PLAN_SCALAR) == sizeof(SCALAR)) return (PLAN_SCALAR *) a;
+  for (j=0; j<n; ++j) buffer[j] = (PLAN_SCALAR) a[j];
+  return buffer;
+}
+
+/* normalized costs of plans, see var_sphBregman */
+static PLAN_SCALAR* plan_cost(var_mph *var_work, int idx_ph) {
+  PLAN_SCALAR *C = var_work->l_var_sphBregman[idx_ph].C;
+  return C ? C : (PLAN_SCALAR *) var_work->g_var[idx_ph].C;
+}
+
+/* @param(C) of n entries divided by rho into the costs of plans @param(Cp) */
+static void normalize_cost(size_t n, SCALAR *C, SCALAR rho, PLAN_SCALAR *Cp) {
+  size_t j;
+  if ((void *) Cp == (void *) C) {for (j=0; j<n; ++j) C[j] /= rho;}
+  else for (j=0; j<n; ++j) Cp[j] = (PLAN_SCALAR) (C[j] / rho);
+}
+
+/**
+ * Step 1-4 of an iteration on the plans of one object (see below) in one
+ * pass: the normalized row sums of its Z are added to @param(acc), and its
+ * residuals (obj, primres, dualres) to @param(res) if it is not NULL.
+ * Marginals are converted to PLAN_SCALAR in @param(buffer), which also
+ * keeps the previous Z, i.e. str * (n + 2) + n entries.
+ */
+static void update_plans(int str, int n, const PLAN_SCALAR *C, SCALAR *w, SCALAR *c_w,
+			 PLAN_SCALAR *X, PLAN_SCALAR *Y, PLAN_SCALAR *Z, SCALAR *Zr, SCALAR *acc,
+			 double *res, PLAN_SCALAR *buffer) {
+  size_t j, strxn = (size_t) str * n;
+  PLAN_SCALAR *Z0 = buffer, *zr = sizeof(PLAN_SCALAR) == sizeof(SCALAR) ? (PLAN_SCALAR *) Zr : buffer + strxn;
+  SCALAR sum;
+  _D2_PLAN_FUNC(cexpnorm)(str, n, Z, C, Y, plan_view(n, w, buffer + strxn + str), ROUNDOFF, X);
+  if (res) for (j=0; j<strxn; ++j) Z0[j] = Z[j];
+  _D2_PLAN_FUNC(rexpnorm)(str, n, X, Y, plan_view(str, c_w, buffer + strxn + str), ROUNDOFF, Z, zr);
+  for (j=0; j<strxn; ++j) Y[j] += X[j] - Z[j];
+  if (res) 
+    for (j=0; j<strxn; ++j) {
+      res[0] += C[j] * X[j];
+      res[1] += fabs(X[j] - Z[j]);
+      res[2] += fabs(Z0[j] - Z[j]);
+    }
+  if ((void *) zr != (void *) Zr) for (j=0; j<(size_t) str; ++j) Zr[j] = zr[j];
+  _D2_FUNC(cnorm)(str, 1, Zr, &sum);
+  _D2_CBLAS_FUNC(axpy)(str, 1, Zr, 1, acc, 1);
+}
+
+/**
+ * Active entries of plans, enabled by p_badmm_options->sparseTol. Once X of
+ * an object converges, most of its entries are pinned at ROUNDOFF by
+ * exp(-C-Y), e.g. for D2_SPARSE_HISTOGRAM where str is the vocab_size. The
+ * entries of an object that are not below sparseTol of the marginal of their
+ * column in X or Z are listed in ascending order at @param(index) + the
+ * offset of its plans, like the column indices of a CSR row, and only them
+ * are updated; the others keep their values. @param(nnz) is the number of
+ * active entries per object, or -1 if more than half are active, where the
+ * dense update is faster.
+ */
+typedef struct {
+  double tol;
+  int *nnz;
+  int *index;
+  PLAN_SCALAR *rest; /* row sums of Z of inactive entries of each object, str per object */
+} active_plans;
+
+/**
+ * Indices of active entries of the plans X and Z (str x n) of an object, and
+ * row sums of Z of the others in @param(rest). An entry below the floor is
+ * still active if X > Z, i.e. Y grows, and Z would reach the floor at the
+ * rate X / Z within @param(loops) iterations.
+ */
+static int select_active(int str, int n, const SCALAR *w, const PLAN_SCALAR *X, const PLAN_SCALAR *Z,
+			 double tol, int loops, __OUT__ int *index, __OUT__ PLAN_SCALAR *rest) {
+  int j, k, nnz = 0;
+  for (j=0; j<str; ++j) rest[j] = 0;
+  for (k=0; k<n; ++k) {
+    double floor = tol * w[k];
+    for (j=k*str; j<(k+1)*str; ++j) {
+      double x = X[j], z = Z[j];
+      if (x >= floor || z >= floor || (x > z && loops * log(x / z) >= log(floor / z))) 
+	index[nnz++] = j;
+      else rest[j - k*str] += Z[j];
+    }
+  }
+  return 2*nnz > str*n ? -1 : nnz;
+}
+
+/**
+ * update_plans() on the @param(nnz) active entries @param(index) only, whose
+ * exponents are gathered into @param(buffer), followed by column and row
+ * sums. Row sums of Z include the inactive entries @param(rest), so that
+ * rows of small weights in the centroid are kept rather than vanishing.
+ */
+static void update_plans_sparse(int str, int n, const PLAN_SCALAR *C, SCALAR *w, SCALAR *c_w,
+				PLAN_SCALAR *X, PLAN_SCALAR *Y, PLAN_SCALAR *Z, SCALAR *Zr, SCALAR *acc,
+				double *res, PLAN_SCALAR *buffer, const int *index, int nnz,
+				const PLAN_SCALAR *rest) {
+  PLAN_SCALAR *t = buffer, *csum = buffer + nnz, *rsum = csum + n;
+  SCALAR sum;
+  int a, j, k, r;
+
+  /* X = Z.*exp(-C-Y), normalized by columns to w */
+  for (a=0; a<nnz; ++a) {j = index[a]; t[a] = -(C[j] + Y[j]);}
+  _D2_PLAN_FUNC(exp)(nnz, t);
+  for (k=0; k<n; ++k) csum[k] = 0;
+  for (a=0, k=0; a<nnz; ++a) {
+    j = index[a]; while (j >= (k+1)*str) ++k;
+    X[j] = Z[j] * t[a] + ROUNDOFF; csum[k] += X[j];
+  }
+  for (k=0; k<n; ++k) csum[k] = (PLAN_SCALAR) w[k] / csum[k];
+  for (a=0, k=0; a<nnz; ++a) {
+    j = index[a]; while (j >= (k+1)*str) ++k;
+    X[j] *= csum[k];
+  }
+
+  /* Z = X.*exp(Y), normalized by rows to c_w, and Y = Y + X - Z */
+  for (a=0; a<nnz; ++a) t[a] = Y[index[a]];
+  _D2_PLAN_FUNC(exp)(nnz, t);
+  for (r=0; r<str; ++r) rsum[r] = rest[r];
+  for (a=0, k=0; a<nnz; ++a) {
+    j = index[a]; while (j >= (k+1)*str) ++k;
+    t[a] = X[j] * t[a] + ROUNDOFF; rsum[j - k*str] += t[a];
+  }
+  for (r=0; r<str; ++r) Zr[r] = rsum[r];
+  for (r=0; r<str; ++r) rsum[r] = rsum[r] > 0 ? (PLAN_SCALAR) c_w[r] / rsum[r] : 0;
+  for (a=0, k=0; a<nnz; ++a) {
+    PLAN_SCALAR z;
+    j = index[a]; while (j >= (k+1)*str) ++k;
+    z = t[a] * rsum[j - k*str];
+    if (res) {
+      res[0] += C[j] * X[j];
+      res[1] += fabs(X[j] - z);
+      res[2] += fabs(Z[j] - z);
+    }
+    Z[j] = z;
+    Y[j] += X[j] - z;
+  }
+  _D2_FUNC(cnorm)(str, 1, Zr, &sum);
+  _D2_CBLAS_FUNC(axpy)(str, 1, Zr, 1, acc, 1);
+}
+
+static active_plans* allocate_active(double tol, size_t size, int str, size_t n) {
+  active_plans *act = (active_plans *) malloc(sizeof(active_plans));
+  size_t i;
+  act->tol = tol;
+  act->nnz = _D2_MALLOC_INT(size); assert(act->nnz);
+  act->index = _D2_MALLOC_INT(n);  assert(act->index);
+  act->rest = _D2_MALLOC_PLAN(str * size); assert(act->rest);
+  for (i=0; i<size; ++i) act->nnz[i] = -1;
+  return act;
+}
+
+static void free_active(active_plans *act) {
+  if (!act) return;
+  _D2_FREE(act->nnz);
+  _D2_FREE(act->index);
+  _D2_FREE(act->rest);
+  free(act);
+}
+
+/**
+ * Step 1-4 on the plans of the i-th object: dense if @param(act) is NULL, or
+ * at @param(is_dense) iterations, which also reselect its active entries, so
+ * that entries regain mass after C is updated, and sparse otherwise.
+ * See is_reselected() for the iterations.
+ */
+static void update_object(sph *data_ph, size_t i, int str, const PLAN_SCALAR *C, SCALAR *c_w,
+			  var_sphBregman *var_phwork, SCALAR *acc, double *res, PLAN_SCALAR *buffer,
+			  active_plans *act, char is_dense) {
+  int n = data_ph->p_str[i];
+  size_t offset = str * data_ph->p_str_cum[i];
+  SCALAR *w = data_ph->p_w + data_ph->p_str_cum[i];
+  PLAN_SCALAR *X = var_phwork->X + offset, *Y = var_phwork->Y + offset, *Z = var_phwork->Z + offset;
+  SCALAR *Zr = var_phwork->Zr + str*i;
+  if (act && !is_dense && act->nnz[i] >= 0) {
+    update_plans_sparse(str, n, C + offset, w, c_w, X, Y, Z, Zr, acc, res, buffer,
+			act->index + offset, act->nnz[i], act->rest + str*i);
+    return;
+  }
+  update_plans(str, n, C + offset, w, c_w, X, Y, Z, Zr, acc, res, buffer);
+  if (act) act->nnz[i] = select_active(str, n, w, X, Z, act->tol, p_badmm_options->updatePerLoops,
+				       act->index + offset, act->rest + str*i);
+}
+
+/**
+ * Whether active entries are reselected at @param(iter): the first
+ * iteration, and those right after step 5 updates C, i.e. the iteration
+ * after each one of iter % updatePerLoops == 0.
+ */
+static char is_reselected(int iter) {
+  return iter == 0 || (iter - 1) % p_badmm_options->updatePerLoops == 0;
+}
+
+/**
+ * Split objects into tiles of about TILE_SIZE bytes of plans (C, X, Y, Z),
+ * where objects of [tile[t], tile[t+1]) are in the t-th tile.
+ */
+static size_t split_tiles(sph *data_ph, size_t size, int str, __OUT__ size_t *tile) {
+  size_t i, num_of_tiles = 0, bytes = TILE_SIZE;
+  for (i=0; i<size; ++i) {
+    if (bytes >= TILE_SIZE) {tile[num_of_tiles++] = i; bytes = 0;}
+    bytes += 4 * sizeof(PLAN_SCALAR) * str * data_ph->p_str[i];
+  }
+  tile[num_of_tiles] = size;
+  return num_of_tiles;
+}
+
+/**
+ * Step 1-4 of an iteration over all objects: tiles are run by threads, each
+ * of which adds the row sums of Z to its own sums in @param(acc) of
+ * str * num_of_labels, and the sums are reduced into c->p_w at the end.
+ * Residuals are summed into @param(res) if it is not NULL. See update_object()
+ * for @param(act, is_dense).
+ */
+static void update_tiles(mph *p_data, var_mph *var_work, int idx_ph, sph *c,
+			 const size_t *tile, size_t num_of_tiles,
+			 SCALAR *acc, double *res, active_plans *act, char is_dense) {
+  sph *data_ph = p_data->ph + idx_ph;
+  int *label = p_data->label;
+  size_t num_of_labels = p_data->num_of_labels;
+  int str = c->str, t, num_of_threads = var_work->num_of_threads;
+  size_t j, strxk = str * num_of_labels;
+  PLAN_SCALAR *C = plan_cost(var_work, idx_ph);
+  var_sphBregman *var_phwork = var_work->l_var_sphBregman + idx_ph;
+  double *thread_res = (double *) calloc(3 * num_of_threads, sizeof(double));
+
+  for (j=0; j<num_of_threads * strxk; ++j) acc[j] = 0;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(num_of_threads)
+#endif
+  {
+    int thread = 0;
+    PLAN_SCALAR *buffer = _D2_MALLOC_PLAN(str * (data_ph->max_str + 2) + data_ph->max_str);
+    long o;
+    size_t i;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for (o=0; o<(long) num_of_tiles; ++o)
+      for (i=tile[o]; i<tile[o+1]; ++i) 
+	update_object(data_ph, i, str, C, c->p_w + str*label[i], var_phwork,
+		      acc + thread*strxk + str*label[i], res ? thread_res + 3*thread : NULL, buffer,
+		      act, is_dense);
+    _D2_FREE(buffer);
+  }
+
+  /* c->p_w is read by all tiles above, so it is updated after them */
+  for (j=0; j<strxk; ++j) c->p_w[j] = acc[j];
+  for (t=1; t<num_of_threads; ++t) 
+    _D2_CBLAS_FUNC(axpy)(strxk, 1, acc + t*strxk, 1, c->p_w, 1);
+  if (res) 
+    for (t=0; t<num_of_threads; ++t) 
+      for (j=0; j<3; ++j) res[j] += thread_res[3*t + j];
+  free(thread_res);
+}
+
+/**
+ * Add supp * X' to @param(c_supp) (dim x str) and row sums of X to
+ * @param(rsum) for the plans X (str x n) of an object with supports
+ * @param(supp) (dim x n).
+ */
+static void accumulate_supp(int dim, int str, int n, SCALAR *supp, PLAN_SCALAR *X,
+			    SCALAR *c_supp, SCALAR *rsum) {
+#ifdef _D2_MIXED
+  int s, k, d;
+  for (s=0; s<n; ++s, supp += dim)
+    for (k=0; k<str; ++k, ++X) {
+      for (d=0; d<dim; ++d) c_supp[d + k*dim] += *X * supp[d];
+      rsum[k] += *X;
+    }
+#else
+  _D2_CBLAS_FUNC(gemm)(CblasColMajor, CblasNoTrans, CblasTrans, 
+		       dim, str, n, 1, supp, dim, X, str, 1, c_supp, dim);
+  _D2_FUNC(rsum2)(str, n, X, rsum);
+#endif
+}
+
+/**
+ * See accumulate_supp(), for an object of D2_WORD_EMBED whose supports are
+ * the embeddings of symbols @param(sym), gathered to @param(supp_buffer)
+ * (dim x n) first.
+ */
+static void accumulate_embed(int dim, int str, int n, const SCALAR *vocab_vec, const int *sym,
+			     PLAN_SCALAR *X, SCALAR *supp_buffer, SCALAR *c_supp, SCALAR *rsum) {
+  int s;
+  for (s=0; s<n; ++s)
+    memcpy(supp_buffer + s*dim, vocab_vec + (size_t) sym[s]*dim, dim * sizeof(SCALAR));
+  accumulate_supp(dim, str, n, supp_buffer, X, c_supp, rsum);
+}
+
+/* objects @param(member) grouped by labels, of [label_cum[l], label_cum[l+1]) for label l */
+static void group_by_labels(const int *label, size_t size, size_t num_of_labels,
+			    __OUT__ size_t *label_cum, __OUT__ size_t *member) {
+  size_t i, l;
+  for (l=0; l<=num_of_labels; ++l) label_cum[l] = 0;
+  for (i=0; i<size; ++i) ++label_cum[label[i] + 1];
+  for (l=0; l<num_of_labels; ++l) label_cum[l+1] += label_cum[l];
+  for (i=0; i<size; ++i) member[label_cum[label[i]]++] = i;
+  for (l=num_of_labels; l>0; --l) label_cum[l] = label_cum[l-1];
+  label_cum[0] = 0;
+}
+
+/**
+ * Iteration at which residuals are checked next after the one at @param(iter).
+ * Without a tolerance @param(tol), it is every 20 iterations in the first 100
+ * and every 100 after. Otherwise, it is when the residual @param(r) would
+ * reach tol at its rate of decrease since @param(r0) at the previous check
+ * @param(last) (-1 if none), within 5 to 100 iterations, and twice the last
+ * interval if it does not decrease.
+ */
+static int next_check(int iter, int last, double r, double r0, double tol) {
+  int interval = iter - last, next;
+  double n;
+  if (tol <= 0) return iter < 99 ? iter + 20 : iter + 100;
+  if (last < 0) return iter + 20;
+  if (r >= r0) next = 2 * interval;
+  else {
+    n = interval * log(tol / r) / log(r / r0);
+    next = n < 100 ? (int) ceil(n) : 100;
+  }
+  if (next < 5) next = 5;
+  if (next > 100) next = 100;
+  return iter + next;
+}
+
+/**
+ * Residual balancing of rho: returns the factor by which rho is scaled, i.e.
+ * p_badmm_options->rhoFactor if the primal residual is RHO_BALANCE times
+ * larger than the dual one, its inverse in the opposite case, and 1
+ * otherwise. A larger rho pulls X and Z together, and a smaller one moves
+ * them faster towards lower costs.
+ */
+static SCALAR balance_rho(double primres, double dualres) {
+  double factor = p_badmm_options->rhoFactor;
+  if (factor == 1) return 1;
+  if (primres > RHO_BALANCE * dualres) return factor;
+  if (dualres > RHO_BALANCE * primres) return 1 / factor;
+  return 1;
+}
+
+/**
+ * Scale rho by @param(tau) for @param(n) entries of plans, where the
+ * normalized cost C/rho and scaled dual Y = Lambda/rho are divided by tau.
+ */
+static void rescale_rho(size_t n, SCALAR tau, PLAN_SCALAR *C, PLAN_SCALAR *Y) {
+  size_t j;
+  for (j=0; j<n; ++j) {C[j] /= tau; Y[j] /= tau;}
+}
+
+#ifndef __USE_MPI__
+/**
+ * Sort supports of the 1-D centroid (@param(c_supp, c_w)) as
+ * sort_centroids_1d(), for its members @param(member) only, with buffers
+ * of str entries.
+ */
+static void sort_centroid_1d(sph *data_ph, const size_t *member, size_t count,
+			     int str, SCALAR *c_supp, SCALAR *c_w,
+			     PLAN_SCALAR **plans, int num_of_plans, int *nnz,
+			     int *perm, PLAN_SCALAR *buffer) {
+  size_t i;
+  int k, p, s;
+  if (d2_sort_supports_1d(str, c_supp, c_w, perm)) return;
+  if (nnz) for (i=0; i<count; ++i) nnz[member[i]] = -1;
+  for (i=0; i<count; ++i) 
+    for (p=0; p<num_of_plans; ++p)
+      for (s=0; s<data_ph->p_str[member[i]]; ++s) {
+	PLAN_SCALAR *x = plans[p] + str*(data_ph->p_str_cum[member[i]] + s);
+	for (k=0; k<str; ++k) buffer[k] = x[perm[k]];
+	for (k=0; k<str; ++k) x[k] = buffer[k];
+      }
+}
+
+/* see calculate_distmat(), for the objects @param(member) only */
+static void calculate_distmat_members(sph *data_ph, int *label, 
+				      const size_t *member, size_t count,
+				      sph *c, SCALAR *C) {
+  sph view = *data_ph;
+  size_t t;
+  for (t=0; t<count; ++t) {
+    size_t i = member[t];
+    view.p_str = data_ph->p_str + i;
+    view.p_str_cum = data_ph->p_str_cum + i;
+    calculate_distmat(&view, label + i, 1, c, C);
+  }
+}
+
+typedef struct {
+  size_t count, label;
+} cluster_task;
+
+static int compare_task(const void *a, const void *b) {
+  size_t x = ((const cluster_task *) a)->count, y = ((const cluster_task *) b)->count;
+  return x > y ? -1 : (x < y);
+}
+
+/**
+ * Cluster-parallel iterations of d2_centroid_sphBregman(), enabled by
+ * d2_badmm_by_cluster. The barycenter of a cluster only depends on its
+ * members, so the iterations of each cluster run over its members as an
+ * independent task, largest clusters first. A cluster checks its own
+ * residuals and stops once they are within the tolerance, or at its share of
+ * the time budget without one, i.e. the budget of all threads times its
+ * share of objects (capped by the budget), rather than all clusters
+ * stopping at the same time. Active entries @param(act) are reselected
+ * right after the iterations of each cluster that update its supports,
+ * see is_reselected(). Not available
+ * with MPI, where members of a cluster are distributed, nor for D2_N_GRAM.
+ */
+static void centroid_by_cluster(mph *p_data, var_mph *var_work, int idx_ph,
+				SCALAR rho, active_plans *act, sph *c) {
+  sph *data_ph = p_data->ph + idx_ph;
+  int *label = p_data->label;
+  size_t num_of_labels = p_data->num_of_labels;
+  size_t size = p_data->size;
+  int dim = data_ph->dim, str = c->str, strxdim = c->str * data_ph->dim;
+  int *p_str = data_ph->p_str;
+  SCALAR *p_supp = data_ph->p_supp;
+  size_t *p_str_cum = data_ph->p_str_cum;
+  int *p_supp_sym = data_ph->p_supp_sym;
+  SCALAR *C = var_work->g_var[idx_ph].C;
+  PLAN_SCALAR *Cp= plan_cost(var_work, idx_ph);
+  PLAN_SCALAR *X = var_work->l_var_sphBregman[idx_ph].X;
+  PLAN_SCALAR *Y = var_work->l_var_sphBregman[idx_ph].Y;
+  PLAN_SCALAR *Z = var_work->l_var_sphBregman[idx_ph].Z;
+  var_sphBregman *var_phwork = var_work->l_var_sphBregman + idx_ph;
+  int max_niter = p_badmm_options->maxIters;
+  double tol = p_badmm_options->tol * tol_scale;
+  size_t l, *label_cum, *member;
+  cluster_task *tasks;
+  int *niter, min_niter = max_niter + 1, max_run = 0;
+  double *res, obj = 0., primres = 0., dualres = 0., startTime = getRealTime();
+
+  label_cum = _D2_MALLOC_SIZE_T(num_of_labels + 1);
+  member = _D2_MALLOC_SIZE_T(size);
+  group_by_labels(label, size, num_of_labels, label_cum, member);
+
+  tasks = (cluster_task *) malloc(num_of_labels * sizeof(cluster_task));
+  for (l=0; l<num_of_labels; ++l) {
+    tasks[l].count = label_cum[l+1] - label_cum[l];
+    tasks[l].label = l;
+  }
+  qsort(tasks, num_of_labels, sizeof(cluster_task), compare_task);
+  niter = _D2_CALLOC_INT(num_of_labels);
+  res = (double *) calloc(3 * num_of_labels, sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads)
+#endif
+  {
+    SCALAR *buffer = _D2_MALLOC_SCALAR(str);
+    PLAN_SCALAR *plan_buffer = _D2_MALLOC_PLAN(str * (data_ph->max_str + 2) + data_ph->max_str);
+    int *perm = _D2_MALLOC_INT(str);
+    SCALAR *supp_buffer = data_ph->metric_type == D2_WORD_EMBED ? _D2_MALLOC_SCALAR(dim * data_ph->max_str) : NULL;
+    long o;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+    for (o=0; o<(long) num_of_labels; ++o) {
+      size_t l = tasks[o].label, count = tasks[o].count, *m = member + label_cum[l], t;
+      SCALAR *c_w = c->p_w + l*str, *c_supp = c->p_supp ? c->p_supp + l*strxdim : NULL;
+      double budget = time_budget * var_work->num_of_threads * count / size;
+      double taskTime = getRealTime();
+      double *res_l = res + 3*l;
+      SCALAR sum;
+      int iter, j, check_iter = next_check(-1, -1, 0, 0, 0), last_check = -1;
+      double r0 = 0.;
+      SCALAR rho_l = rho; /* rho of the cluster */
+      if (budget > time_budget || var_work->num_of_threads == 1) budget = time_budget;
+
+      for (iter=0; iter <= max_niter; ++iter) {
+	char is_checked = (iter == check_iter);
+	/* step 1-4: update X, Z and Y of each member, and c_w, with residuals of the cluster */
+	if (is_checked) res_l[0] = res_l[1] = res_l[2] = 0.;
+	for (j=0; j<str; ++j) buffer[j] = 0;
+	for (t=0; t<count; ++t) 
+	  update_object(data_ph, m[t], str, Cp, c_w, var_phwork, buffer, is_checked ? res_l : NULL,
+			plan_buffer, act, is_reselected(iter));
+	for (j=0; j<str; ++j) c_w[j] = buffer[j];
+	_D2_FUNC(cnorm)(str, 1, c_w, &sum);
+
+	/* step 5: update c_supp (optional) */
+	if (iter % p_badmm_options->updatePerLoops == 0 && 
+	    (data_ph->metric_type == D2_EUCLIDEAN_L2 || data_ph->metric_type == D2_WORD_EMBED)) {
+	  SCALAR *rsum = buffer;
+	  for (j=0; j<strxdim; ++j) c_supp[j] = 0.f;
+	  for (j=0; j<str; ++j) rsum[j] = 0.f;
+	  for (t=0; t<count; ++t) {
+	    size_t i = m[t];
+	    if (data_ph->metric_type == D2_EUCLIDEAN_L2) {
+	      accumulate_supp(dim, str, p_str[i], p_supp + dim*p_str_cum[i], X + str*p_str_cum[i], c_supp, rsum);
+	    } else {
+	      accumulate_embed(dim, str, p_str[i], data_ph->vocab_vec, p_supp_sym + p_str_cum[i],
+			       X + str*p_str_cum[i], supp_buffer, c_supp, rsum);
+	    }
+	  }
+	  _D2_FUNC(irms)(dim, str, c_supp, rsum);
+	  if (data_ph->metric_type == D2_EUCLIDEAN_L2 && dim == 1) {
+	    PLAN_SCALAR *plans[3] = {X, Y, Z};
+	    sort_centroid_1d(data_ph, m, count, str, c_supp, c_w, plans, 3, act ? act->nnz : NULL, perm, plan_buffer);
+	  }
+
+	  // re-calculate C
+	  calculate_distmat_members(data_ph, label, m, count, c, C);
+	  for (t=0; t<count; ++t) 
+	    normalize_cost(str*p_str[m[t]], C + str*p_str_cum[m[t]], rho_l, Cp + str*p_str_cum[m[t]]);
+	}
+
+	/* step 6: check residuals of the cluster */
+	if (is_checked) {
+	  double r = (res_l[1] > res_l[2] ? res_l[1] : res_l[2]) / count;
+	  SCALAR tau;
+	  if (r < tol) {++iter; break;}
+	  tau = balance_rho(res_l[1], res_l[2]);
+	  if (tau != 1) {
+	    for (t=0; t<count; ++t) 
+	      rescale_rho(str*p_str[m[t]], tau, Cp + str*p_str_cum[m[t]], Y + str*p_str_cum[m[t]]);
+	    res_l[0] /= tau; rho_l *= tau;
+	  }
+	  check_iter = next_check(iter, last_check, r, r0, tol);
+	  if (tol > 0 && check_iter > max_niter) check_iter = max_niter;
+	  last_check = iter; r0 = r;
+	}
+
+	if (tol == 0 && getRealTime() - taskTime > budget) {++iter; break;}
+      }
+      niter[l] = iter;
+      res_l[0] *= rho_l / rho; // obj of the cluster is reported at rho
+    }
+    _D2_FREE(buffer);
+    _D2_FREE(plan_buffer);
+    _D2_FREE(perm);
+    if (supp_buffer) _D2_FREE(supp_buffer);
+  }
+
+  for (l=0; l<num_of_labels; ++l) {
+    obj += res[3*l]; primres += res[3*l+1]; dualres += res[3*l+2];
+    if (niter[l] < min_niter) min_niter = niter[l];
+    if (niter[l] > max_run) max_run = niter[l];
+  }
+  VPRINTF("\t%d\t%f\t%f\t%f\t%f\n", max_run, obj * rho / p_data->global_size, 
+	  primres / p_data->global_size, dualres / p_data->global_size, getRealTime() - startTime);
+  VPRINTF("\tclusters run %d to %d iterations\n", min_niter, max_run);
+
+  free(tasks);
+  free(res);
+  _D2_FREE(niter);
+  _D2_FREE(label_cum);
+  _D2_FREE(member);
+}
+#endif
 
 /**
  * See matlab/centroid_sphBregman.m 
@@ -68,13 +683,21 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
   size_t *p_str_cum = data_ph->p_str_cum;
   int *p_supp_sym = data_ph->p_supp_sym;
   SCALAR *C = var_work->g_var[idx_ph].C;
-  SCALAR *X = var_work->l_var_sphBregman[idx_ph].X;
-  SCALAR *Y = var_work->l_var_sphBregman[idx_ph].Y;
-  SCALAR *Z = var_work->l_var_sphBregman[idx_ph].Z;
+  PLAN_SCALAR *Cp= plan_cost(var_work, idx_ph);
+  PLAN_SCALAR *X = var_work->l_var_sphBregman[idx_ph].X;
+  PLAN_SCALAR *Y = var_work->l_var_sphBregman[idx_ph].Y;
+  PLAN_SCALAR *Z = var_work->l_var_sphBregman[idx_ph].Z;
   SCALAR *Xc= var_work->l_var_sphBregman[idx_ph].Xc;
   SCALAR *Zr= var_work->l_var_sphBregman[idx_ph].Zr; 
-  SCALAR *Zr2 = Zr; char hasZr2 = 0;
-  double startTime;
+  SCALAR *Zr2 = NULL; /* accumulation of symbols of a label followed by a buffer, for D2_N_GRAM */
+  int *touched = NULL;
+  symbolic_entry *Zs = NULL;
+  size_t *label_cum = NULL, *member = NULL;
+#ifdef __USE_MPI__
+  int *slot_counts = NULL, *slot_displs = NULL; /* supports minimized by each node, for D2_N_GRAM */
+#endif
+  SCALAR *supp_buffer = NULL; /* supports of an object gathered from vocab_vec, for D2_WORD_EMBED */
+  double startTime, res[3];
 
   /**
    * MPI notes: vector needs synchronized __USE_MPI__ : 
@@ -87,9 +710,12 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 
   size_t i; int j;
   int max_niter = p_badmm_options->maxIters, iter;
+  int check_iter = next_check(-1, -1, 0, 0, 0), last_check = -1;
+  double tol = p_badmm_options->tol * tol_scale, r0 = 0.;
   SCALAR rho, obj, primres, dualres;
-  SCALAR *Z0;
-  size_t *label_count;
+  SCALAR *acc;
+  size_t *label_count, *tile, num_of_tiles;
+  active_plans *act = NULL;
 
   /* Initialization */
   if (!c0) {
@@ -107,7 +733,7 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 
   /* rho is an important hyper-parameter */
   rho = p_badmm_options->rhoCoeff * _D2_CBLAS_FUNC(asum)(str*col, C, 1) / (str*col);
-  for (i=0; i<str*col; ++i) C[i] /= rho; // normalize C and Y
+  normalize_cost(str*col, C, rho, Cp); // normalize C and Y
 
   /* 
    * Indeed, we may only need to reinitialize for entries 
@@ -115,7 +741,7 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
    */
   for (i=0; i<size; ++i) {
     if (label_switch[i] == 1) {
-      SCALAR *p_scal = Z + str*p_str_cum[i];
+      PLAN_SCALAR *p_scal = Z + str*p_str_cum[i];
       SCALAR *data_w_scal  = p_w + p_str_cum[i];
       SCALAR *c_w_scal = c->p_w + label[i]*str;
       for (j=0; j<str*p_str[i]; ++j, ++p_scal) 
@@ -123,12 +749,22 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
     }
   }
 
-  // allocate buffer of Z
-  Z0 = _D2_MALLOC_SCALAR(str*col);
   for (i=0; i<str*col; ++i) Y[i] = 0; // set Y to zero
-  if (str * num_of_labels * (strxdim * data_ph->vocab_size + 1) > size*str - c->col && data_ph->metric_type == D2_N_GRAM) {
-    Zr2 = _D2_MALLOC_SCALAR(str * num_of_labels * (strxdim * data_ph->vocab_size + 1));    
-    hasZr2 = 1;
+  if (p_badmm_options->sparseTol > 0) act = allocate_active(p_badmm_options->sparseTol, size, str, str*col);
+  if (data_ph->metric_type == D2_N_GRAM) {
+    size_t n = (size_t) strxdim * data_ph->vocab_size;
+    Zr2 = _D2_CALLOC_SCALAR(n + data_ph->vocab_size); assert(Zr2);
+    touched = _D2_MALLOC_INT(n); assert(touched);
+    /* a label has at most n entries, and at most str x dim per support of its members */
+    Zs = (symbolic_entry *) malloc((num_of_labels * n < col * strxdim ? num_of_labels * n : col * strxdim) * sizeof(symbolic_entry));
+    assert(Zs);
+    label_cum = _D2_MALLOC_SIZE_T(num_of_labels + 1);
+    member = _D2_MALLOC_SIZE_T(size);
+    group_by_labels(label, size, num_of_labels, label_cum, member);
+#ifdef __USE_MPI__
+    slot_counts = _D2_MALLOC_INT(nprocs);
+    slot_displs = _D2_MALLOC_INT(nprocs);
+#endif
   }
   /**
    *  Calculate labels counts:
@@ -146,43 +782,32 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
   // main loop
   VPRINTF("\titer\tobj\t\tprimres\t\tdualres\t\tseconds\n");
   VPRINTF("\t----------------------------------------------------------------\n");
+#ifndef __USE_MPI__
+  if (d2_badmm_by_cluster && data_ph->metric_type != D2_N_GRAM) {
+    centroid_by_cluster(p_data, var_work, idx_ph, rho, act, c);
+    _D2_FREE(label_count);
+    free_active(act);
+    return 0;
+  }
+#endif
+  if (data_ph->metric_type == D2_WORD_EMBED) {
+    supp_buffer = _D2_MALLOC_SCALAR(dim * data_ph->max_str); assert(supp_buffer);
+  }
+  tile = _D2_MALLOC_SIZE_T(size + 1);
+  num_of_tiles = split_tiles(data_ph, size, str, tile);
+  acc = _D2_MALLOC_SCALAR(var_work->num_of_threads * str * num_of_labels);
   startTime = getRealTime();
   for (iter=0; iter <= max_niter; ++iter) {
+    char is_checked = (iter == check_iter);
     /*************************************************************************/
-    // step 1: update X
-
-    // X = Z.*exp(- (C + Y)/rho)
-    for (i=0; i<str*col; ++i) {
-      X[i] = Z[i] * exp (- (C[i] + Y[i])) + ROUNDOFF;
-    }      
-    _D2_FUNC(cnorm)(str, col, X, Xc); 
-    _D2_FUNC(grms)(str, col, X, p_w);
-
-    /*************************************************************************/
-    // step 2: update Z
-    // Z = X.*exp(Y/rho)
-    for (i=0; i<str*col; ++i) {
-      Z0[i] = Z[i];
-      Z[i]  = X[i] * exp(Y[i]) + ROUNDOFF;
-    }
-    for (i=0;i<size; ++i) {
-      _D2_FUNC(rnorm)(str, p_str[i], Z + str*p_str_cum[i], Zr + str*i); 
-      _D2_FUNC(gcms)(str, p_str[i], Z + str*p_str_cum[i], c->p_w + str*label[i]);
-    }
-   
-    /*************************************************************************/
-    // step 3: update Y
-    for (i=0; i<str*col; ++i) Y[i] += X[i] - Z[i];
-
-    /*************************************************************************/
-    // step 4: update c->p_w
-    for (i=0; i<str*num_of_labels; ++i) c->p_w[i] = 0; //reset c->p_w locally
-    _D2_FUNC(cnorm)(str, size, Zr, Xc);
-
-
-    // ADD vec(&Zr[str*i], str) TO vec(&c->p_w[label[i]*str], str)
-    for (i=0; i<size; ++i) 
-      _D2_CBLAS_FUNC(axpy)(str, 1, Zr + str*i, 1, c->p_w +label[i]*str, 1);
+    // step 1-4: update X, Z and Y of each object in one pass over tiles of objects
+    //   X = Z.*exp(- (C + Y)/rho), normalized by columns to p_w
+    //   Z = X.*exp(Y/rho), normalized by rows to c->p_w
+    //   Y = Y + X - Z
+    // and sum normalized rows of Z to c->p_w, with residuals when they are checked
+    res[0] = res[1] = res[2] = 0.;
+    update_tiles(p_data, var_work, idx_ph, c, tile, num_of_tiles, acc, is_checked ? res : NULL,
+		 act, is_reselected(iter));
 #ifdef __USE_MPI__
     /* ALLREDUCE by SUM operator: vec(c->p_w, c->col) */
     MPI_Allreduce(MPI_IN_PLACE, c->p_w, c->col, MPI_SCALAR, MPI_SUM, MPI_COMM_WORLD);
@@ -202,13 +827,10 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 	  /* ADD mat(&p_supp[p_str_cum[i]*dim], dim, p_str[i]) * 
 	         mat(&X[p_str_cum[i]*str], str, p_str[i]).transpose 
 	     TO mat(&c->p_supp[label[i]*strxdim], dim, str)
-	   */
-	  _D2_CBLAS_FUNC(gemm)(CblasColMajor, CblasNoTrans, CblasTrans, 
-			       dim, str, p_str[i], 1, p_supp + dim*p_str_cum[i], dim, X + str*p_str_cum[i], str, 1, 
-			       c->p_supp + label[i]*strxdim, dim);
-	  /* ADD row_of_sums of mat(&X[p_str_cum[i]*str], str, p_str[i]) 
+	     and ADD row_of_sums of mat(&X[p_str_cum[i]*str], str, p_str[i]) 
 	     To vec(&Zr[label[i]*str], str) */
-	  _D2_FUNC(rsum2)(str, p_str[i], X + str*p_str_cum[i], Zr + label[i]*str);
+	  accumulate_supp(dim, str, p_str[i], p_supp + dim*p_str_cum[i], X + str*p_str_cum[i],
+			  c->p_supp + label[i]*strxdim, Zr + label[i]*str);
 	}
 #ifdef __USE_MPI__
 	/* ALLREDUCE by SUM operator: vec(c->p_supp, c->col*dim) */
@@ -219,31 +841,24 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 	for (i=0; i<num_of_labels; ++i) {
 	  _D2_FUNC(irms)(dim, str, c->p_supp + i*strxdim, Zr + i*str);
 	}
-
+	if (dim == 1) {
+	  PLAN_SCALAR *plans[3] = {X, Y, Z};
+	  sort_centroids_1d(data_ph, label, size, c, num_of_labels, plans, 3, act ? act->nnz : NULL);
+	}
 
 	// re-calculate C
 	calculate_distmat(data_ph, label, size, c, C);
 	/* rho is an important hyper-parameter */
-	for (i=0; i<str*col; ++i) C[i] /= rho; // normalize C and Y
+	normalize_cost(str*col, C, rho, Cp); // normalize C and Y
 	break;
       case D2_WORD_EMBED :
 	assert(num_of_labels < size);
 	for (i=0; i<strxdim*num_of_labels; ++i) c->p_supp[i] = 0.f;
 	for (i=0; i<c->col; ++i) Zr[i] = 0.f; //reset Zr to temporarily storage
 	for (i=0; i<size; ++i) {
-	  int *m_supp_sym = p_supp_sym + p_str_cum[i];
-	  SCALAR *Xm = X + str*p_str_cum[i];
-	  SCALAR *Zrm = Zr + label[i]*str;
-	  int j, k, d;
-	  for (j=0; j<p_str[i]; ++j) {
-	    SCALAR *c_supp = c->p_supp + label[i]*strxdim;
-	    SCALAR *vocab_vec=&data_ph->vocab_vec[m_supp_sym[j]*dim];
-	    for (k=0; k<str; ++k, ++Xm) {
-	      for (d=0; d<dim; ++d, ++c_supp)		
-		*c_supp += *Xm *  vocab_vec[d];
-	      Zrm[k] += *Xm;
-	    }
-	  }
+	  /* same as D2_EUCLIDEAN_L2 with supports gathered from vocab_vec */
+	  accumulate_embed(dim, str, p_str[i], data_ph->vocab_vec, p_supp_sym + p_str_cum[i],
+			   X + str*p_str_cum[i], supp_buffer, c->p_supp + label[i]*strxdim, Zr + label[i]*str);
 	}
 #ifdef __USE_MPI__
 	/* ALLREDUCE by SUM operator: vec(c->p_supp, c->col*dim) */
@@ -258,7 +873,7 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 	// re-calculate C
 	calculate_distmat(data_ph, label, size, c, C);
 	/* rho is an important hyper-parameter */
-	for (i=0; i<str*col; ++i) C[i] /= rho; // normalize C and Y
+	normalize_cost(str*col, C, rho, Cp); // normalize C and Y
 
 	break;
 
@@ -268,41 +883,38 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
 
       case D2_N_GRAM :
 	if (iter > 0) {
-	  //assert(num_of_labels * (strxdim * data_ph->vocab_size + 1) <= size);
-
-	for (i=0; i<num_of_labels*strxdim*data_ph->vocab_size; ++i) Zr2[i] = 0; //reset Zr to temporarily storage
-	for (i=0; i<size; ++i) {
-	  accumulate_symbolic(dim, str, p_str[i], 
-			      p_supp_sym + dim*p_str_cum[i], 
-			      Z + str*p_str_cum[i], 
-			      Zr2 + label[i]*strxdim*data_ph->vocab_size,
-			      data_ph->vocab_size);	  
-	}
+	size_t n = (size_t) strxdim * data_ph->vocab_size, count = 0;
+	symbolic_entry *Zs_all = Zs;
+	/* accumulate symbols of Z label by label as sparse entries (support, symbol, weight) */
+	for (i=0; i<num_of_labels; ++i) 
+	  count += accumulate_symbolic_sparse(data_ph, Z, str, member + label_cum[i], label_cum[i+1] - label_cum[i],
+					      i*n, Zr2, touched, Zs + count);
 #ifdef __USE_MPI__
-	/* ALLREDUCE by SUM operator: vec(Zr2, num_of_labels*str*dim*data_ph->vocab_size) */
-	MPI_Allreduce(MPI_IN_PLACE, Zr2, c->col * dim * data_ph->vocab_size, MPI_SCALAR, MPI_SUM, MPI_COMM_WORLD);
+	/* sum up entries of all nodes by supports, which are sparse unlike vec(Zr2, num_of_labels*str*dim*data_ph->vocab_size),
+	   so that each node only minimizes its own supports */
+	Zs_all = reduce_scatter_symbolic(&count, Zs, (size_t) num_of_labels * strxdim, data_ph->vocab_size, slot_counts, slot_displs);
+#endif
+	minimize_symbolic_sparse(count, Zs_all, data_ph->vocab_size, data_ph->dist_mat, c->p_supp_sym, Zr2 + n);
+#ifdef __USE_MPI__
+	free(Zs_all);
+	/* ALLGATHER supports of all nodes: vec(c->p_supp_sym, num_of_labels*strxdim) */
+	MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, c->p_supp_sym, slot_counts, slot_displs, MPI_INT, MPI_COMM_WORLD);
 #endif
-	for (i=0; i<num_of_labels; ++i) {
-	  minimize_symbolic(dim, str, c->p_supp_sym + i*strxdim, Zr2 + i*strxdim*data_ph->vocab_size, data_ph->vocab_size, data_ph->dist_mat, Zr2 + num_of_labels*strxdim*data_ph->vocab_size);
-	}
 
 	// re-calculate C
 	calculate_distmat(data_ph, label, size, c, C);
 	/* rho is an important hyper-parameter */
-	for (i=0; i<str*col; ++i) C[i] /= rho; // normalize C and Y
+	normalize_cost(str*col, C, rho, Cp); // normalize C and Y
 	}
 	break;
       }
     }    
 
     /*************************************************************************/
-    // step 6: check residuals
-    if ((iter%100==99 ) || (iter < 100 && iter%20 == 19))  {
-      obj = _D2_CBLAS_FUNC(dot)(str*col, C, 1, X, 1);
-      _D2_CBLAS_FUNC(axpy)(str*col, -1, Z, 1, X, 1);
-      _D2_CBLAS_FUNC(axpy)(str*col, -1, Z, 1, Z0,1);
-      primres = _D2_CBLAS_FUNC(asum)(str*col, X, 1);
-      dualres = _D2_CBLAS_FUNC(asum)(str*col,Z0, 1);
+    // step 6: check residuals, and stop once they are within the tolerance
+    if (is_checked)  {
+      double r;
+      obj = res[0]; primres = res[1]; dualres = res[2];
 #ifdef __USE_MPI__
       /* ALLREDUCE by SUM operator: obj, primres, dualres */
       MPI_Allreduce(MPI_IN_PLACE, &obj,     1, MPI_SCALAR, MPI_SUM, MPI_COMM_WORLD);
@@ -313,13 +925,39 @@ int d2_centroid_sphBregman(mph *p_data, /* local data */
       primres /= p_data->global_size;
       dualres /= p_data->global_size;
       VPRINTF("\t%d\t%f\t%f\t%f\t%f\n", iter+1, obj, primres, dualres, getRealTime() - startTime);
+      r = primres > dualres ? primres : dualres;
+      if (r < tol) break;
+      {
+	SCALAR tau = balance_rho(primres, dualres);
+	if (tau != 1) {
+	  rescale_rho(str*col, tau, Cp, Y);
+	  rho *= tau;
+	}
+      }
+      check_iter = next_check(iter, last_check, r, r0, tol);
+      if (tol > 0 && check_iter > max_niter) check_iter = max_niter;
+      last_check = iter; r0 = r;
     }
 
-    if (getRealTime() - startTime > time_budget) {break;}
+    // the time budget is only used without a tolerance, as it varies with loads
+    if (tol == 0 && getRealTime() - startTime > time_budget) {break;}
   }
 
-  _D2_FREE(Z0);
+  _D2_FREE(tile);
+  _D2_FREE(acc);
+  free_active(act);
   _D2_FREE(label_count);
-  if (hasZr2) _D2_FREE(Zr2);
+  if (supp_buffer) _D2_FREE(supp_buffer);
+  if (Zr2) {
+    _D2_FREE(Zr2);
+    _D2_FREE(touched);
+    free(Zs);
+    _D2_FREE(label_cum);
+    _D2_FREE(member);
+#ifdef __USE_MPI__
+    _D2_FREE(slot_counts);
+    _D2_FREE(slot_displs);
+#endif
+  }
   return 0;
 }
@@ -22,7 +22,7 @@ int d2_centroid_sphGradDecent(mph *p_data,
   
 
   size_t i;
-  int iter, nIter = p_graddec_options->maxIters;
+  int iter, nIter = p_graddec_options->maxIters, failed;
   double fval0, fval = DBL_MAX;
   int *label = p_data->label;
   size_t num_of_labels = p_data->num_of_labels;
@@ -77,15 +77,22 @@ int d2_centroid_sphGradDecent(mph *p_data,
 
     fval0 = fval;
     fval = 0;
+    failed = 0;
 
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:fval,failed)
+#endif
     for (i=0; i<size; ++i) {
-      fval += d2_match_by_distmat(str, p_str[i],
+      double val = d2_match_by_distmat_ctx(d2_get_solver_context(var_work),
+				  str, p_str[i],
 				  C + str*p_str_cum[i],
 				  c->p_w + label[i]*str, p_w + p_str_cum[i],
 				  X + p_str_cum[i]*str,
 				  L + i*str,
-				  i); // known bug as work for only one phase      
+				  i*num_of_labels + label[i]); // known bug as work for only one phase      
+      if (val == D2_SOLVER_ERROR) ++failed; else fval += val;
     }
+    if (failed) {printf("\t%d transportation problems are not solved\n", failed); break;}
     fval /= size;
   
     printf("\t%d\t%f\t%f\n", iter, fval, getRealTime() - startTime);    
@@ -0,0 +1,122 @@
+#include "d2/clustering.h"
+#include "d2/param.h"
+#include "d2/centroid_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : (x > y);
+}
+
+/* put mass at a fractional bin q, split to its two neighboring bins */
+static void deposit(SCALAR *w, int str, double q, double mass) {
+  int lo = (int) q;
+  double frac = q - lo;
+  if (lo >= str - 1) {w[str-1] += mass; return;}
+  w[lo]   += mass * (1 - frac);
+  w[lo+1] += mass * frac;
+}
+
+/**
+ * Closed-form centroids of a D2_HISTOGRAM phase whose dist_mat is
+ * hist_scale * |i-j|^hist_power (see sph), where each cluster is updated
+ * from the cumulative distributions F of its members, without any solver:
+ *
+ * hist_power = 1: the cumulative distribution of the barycenter minimizes
+ * sum ||F_c - F||_1, which is the pointwise median of the members' F.
+ *
+ * hist_power = 2: the quantile function of the barycenter is the mean of
+ * the members' quantile functions. Their sum at level t counts the pairs
+ * (member, bin) of F(bin) <= t, so the levels are visited by sorting all
+ * F(bin), and the mass at a fractional bin is split to its two neighbors,
+ * which keeps the mean of the barycenter.
+ *
+ * It is not available with MPI, where members of a cluster are distributed,
+ * and update_centroids() falls back to the selected centroid method.
+ */
+int d2_centroid_sphQuantile(mph *p_data,
+			    int idx_ph,
+			    sph *c0,
+			    __OUT__ sph *c) {
+  sph *data_ph = p_data->ph + idx_ph;
+  int *label = p_data->label;
+  size_t num_of_labels = p_data->num_of_labels;
+  size_t size = p_data->size;
+  int str = data_ph->vocab_size, p = data_ph->hist_power;
+  size_t i, l, *label_cum, *member, max_count = 0;
+  double *F, *buffer;
+  int k;
+
+  assert(p == 1 || p == 2);
+
+  if (!c0) {
+    d2_centroid_rands(p_data, idx_ph, c);
+    broadcast_centroids(p_data, idx_ph);
+  } else {
+    *c = *c0;
+  }
+  assert(c->str == str);
+
+  /* cumulative distributions of objects, the last bin of which is 1 */
+  F = (double *) malloc(size * (str-1) * sizeof(double));
+  for (i=0; i<size; ++i) {
+    const SCALAR *w = data_ph->p_w + data_ph->p_str_cum[i];
+    double cum = 0.;
+    assert(data_ph->p_str[i] == str);
+    for (k=0; k<str-1; ++k) {
+      cum += w[k];
+      F[i*(str-1) + k] = cum > 1. ? 1. : cum;
+    }
+  }
+
+  /* group objects by labels */
+  label_cum = _D2_CALLOC_SIZE_T(num_of_labels + 1);
+  member = _D2_MALLOC_SIZE_T(size);
+  for (i=0; i<size; ++i) ++label_cum[label[i] + 1];
+  for (l=0; l<num_of_labels; ++l) {
+    if (label_cum[l+1] > max_count) max_count = label_cum[l+1];
+    label_cum[l+1] += label_cum[l];
+  }
+  for (i=0; i<size; ++i) member[label_cum[label[i]]++] = i;
+  for (l=num_of_labels; l>0; --l) label_cum[l] = label_cum[l-1];
+  label_cum[0] = 0;
+
+  buffer = (double *) malloc((max_count * (str-1) + 1) * sizeof(double));
+  for (l=0; l<num_of_labels; ++l) {
+    size_t count = label_cum[l+1] - label_cum[l], *m = member + label_cum[l];
+    SCALAR *c_w = c->p_w + l*str;
+    if (count == 0) continue; // keep the centroid of an empty cluster
+
+    if (p == 1) {
+      double prev = 0.;
+      for (k=0; k<str-1; ++k) {
+	for (i=0; i<count; ++i) buffer[i] = F[m[i]*(str-1) + k];
+	qsort(buffer, count, sizeof(double), compare_double);
+	if (buffer[(count-1)/2] < prev) buffer[(count-1)/2] = prev;
+	c_w[k] = buffer[(count-1)/2] - prev;
+	prev = buffer[(count-1)/2];
+      }
+      c_w[str-1] = 1. - prev;
+    } else {
+      double t = 0.;
+      size_t n = count * (str-1);
+      for (i=0; i<count; ++i)
+	for (k=0; k<str-1; ++k) buffer[i*(str-1) + k] = F[m[i]*(str-1) + k];
+      qsort(buffer, n, sizeof(double), compare_double);
+      for (k=0; k<str; ++k) c_w[k] = 0.;
+      for (i=0; i<n; ++i) {
+	deposit(c_w, str, (double) i / count, buffer[i] - t);
+	t = buffer[i];
+      }
+      deposit(c_w, str, (double) n / count, 1. - t);
+    }
+  }
+
+  free(buffer);
+  free(F);
+  _D2_FREE(label_cum);
+  _D2_FREE(member);
+  return 0;
+}
@@ -34,6 +34,8 @@ int d2_centroid_randn(mph *p_data, int idx_ph, sph *c) {
   // set dist_mat
   if (dim == 0) {
     for (i=0; i<str * str; ++i) c->dist_mat[i] = data_ph->dist_mat[i];
+    c->hist_power = data_ph->hist_power;
+    c->hist_scale = data_ph->hist_scale;
   }
   
   // compute mean and cov
@@ -157,14 +159,18 @@ void merge         (const int dim,
   _D2_FREE(D); _D2_FREE(supp); _D2_FREE(w);
 }
 
-/* initialize with random samples */
-int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
-  size_t i, j, *array; int k;
+/**
+ * Initialize the j-th of @param(count) centroids of a phase from the
+ * samples[j]-th object, whose supports are merged if there are more than
+ * c->str of them. Centroids of samples[j] >= size (objects on the other
+ * processors) are set to zero, so that they can be summed by
+ * broadcast_centroids().
+ */
+int d2_centroid_sample(mph *p_data, int idx_ph, const size_t *samples, size_t count, sph *c) {
+  size_t i, j; int k;
   sph *data_ph = p_data->ph + idx_ph;
-  size_t num_of_labels = p_data->num_of_labels;
   int dim = data_ph->dim;
   int str = data_ph->str;
-  size_t vocab_size = data_ph->vocab_size;
   size_t size = p_data->size;
   int strxdim = str*dim;
 
@@ -174,13 +180,13 @@ int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
   assert(c->str == str);
 
   // set stride
-  for (i=0; i<num_of_labels; ++i) {
+  for (i=0; i<count; ++i) {
     c->p_str[i] = str;
     c->p_str_cum[i] = i*str;
   }
 
   // set column
-  c->col = str * num_of_labels;
+  c->col = str * count;
 
   // set vocab_size and dist_mat
   if (data_ph->metric_type == D2_HISTOGRAM ||
@@ -188,13 +194,11 @@ int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
       data_ph->metric_type == D2_N_GRAM) {
     c->dist_mat = data_ph->dist_mat;
     c->vocab_size = data_ph->vocab_size;
+    // centroid distances of closed forms, see has_quantile()
+    c->hist_power = data_ph->hist_power;
+    c->hist_scale = data_ph->hist_scale;
   }
   
-  // generate index array
-  array = _D2_MALLOC_SIZE_T(size);
-  for (i = 0; i < size; ++i) array[i] = i;
-  shuffle(array, size);
-
   // set to zero
   for (i=0; i<c->col; ++i) c->p_w[i] = 0;
   if (c->metric_type == D2_EUCLIDEAN_L2) {
@@ -204,21 +208,14 @@ int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
     for (i=0; i<c->col * c->dim; ++i) c->p_supp_sym[i] = 0;
   }
 
-  
-
-  i = 0; j = world_rank;
-
-  while (i<size && j<num_of_labels) {
+  for (j=0; j<count; ++j) {
     int the_str;
     size_t the_str_cum;
 
-    while (i<size &&
-	   data_ph->p_str[array[i]] < str &&
-	   data_ph->metric_type != D2_SPARSE_HISTOGRAM ) { ++i; }
-    
-    if (i == size) break;
-    the_str = data_ph->p_str[array[i]];
-    the_str_cum = data_ph->p_str_cum[array[i]];
+    if (samples[j] >= size) continue;
+    i = samples[j];
+    the_str = data_ph->p_str[i];
+    the_str_cum = data_ph->p_str_cum[i];
 
     switch (data_ph->metric_type) {
     case D2_HISTOGRAM:
@@ -262,8 +259,7 @@ int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
       // very simple way to initialize
       m_supp_sym = data_ph->p_supp_sym + the_str_cum;
       m_w = data_ph->p_w + the_str_cum;
-      for (k=0; k<str; ++k) c->p_w[k] = 0.f;
-      for (k=0; k<the_str; ++k) c->p_w[m_supp_sym[k]] = m_w[k];
+      for (k=0; k<the_str; ++k) c->p_w[j*str + m_supp_sym[k]] = m_w[k];
       break;
     case D2_N_GRAM: 
       m_supp_sym = data_ph->p_supp_sym + the_str_cum*dim;
@@ -282,15 +278,48 @@ int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
       fprintf(stderr, "Unknown type of data!");
       assert(false);
     }
+  }
+  return 0;
+}
+
+/* initialize with random samples */
+int d2_centroid_rands(mph *p_data, int idx_ph, sph *c) {
+  size_t i, j, *array, *samples;
+  sph *data_ph = p_data->ph + idx_ph;
+  size_t num_of_labels = p_data->num_of_labels;
+  int str = data_ph->str;
+  size_t size = p_data->size;
+
+  // generate index array
+  array = _D2_MALLOC_SIZE_T(size);
+  for (i = 0; i < size; ++i) array[i] = i;
+  shuffle(array, size);
+
+  // pick samples of enough supports, and leave the others to other processors
+  samples = _D2_MALLOC_SIZE_T(num_of_labels);
+  for (j=0; j<num_of_labels; ++j) samples[j] = size;
+
+  i = 0; j = world_rank;
+
+  while (i<size && j<num_of_labels) {
+    while (i<size &&
+	   data_ph->p_str[array[i]] < str &&
+	   data_ph->metric_type != D2_SPARSE_HISTOGRAM ) { ++i; }
+    
+    if (i == size) break;
+    samples[j] = array[i];
     ++i; j+= nprocs;
   }
 
   free(array);
 
   if (j < num_of_labels) {
-    fprintf(stderr, "rank %d error: couldn't find enough samples with stride >= %d for initializating %d centroids\n",
+    fprintf(stderr, "rank %d error: couldn't find enough samples with stride >= %d for initializating %zd centroids\n",
 	    world_rank, str, num_of_labels);
     exit(1);
   }  
+
+  d2_centroid_sample(p_data, idx_ph, samples, num_of_labels, c);
+  _D2_FREE(samples);
   return 0;
 }
@@ -1,9 +1,11 @@
 #include "d2/clustering.h"
 #include "d2/math.h"
 #include "d2/param.h"
+#include "d2/centroid_util.h"
 #include <stdio.h>
 #include <float.h>
 #include <assert.h>
+#include <limits.h>
 
 void calculate_distmat(sph *data_ph, int* label, size_t size, sph *c, SCALAR* C) {
   int dim = c->dim, str = c->str, strxdim = c->dim*c->str;
@@ -34,3 +36,115 @@ void calculate_distmat(sph *data_ph, int* label, size_t size, sph *c, SCALAR* C)
     break;
   }
 }
+
+static int compare_int(const void *a, const void *b) {
+  int x = *(const int *) a, y = *(const int *) b;
+  return x < y ? -1 : (x > y);
+}
+
+static int compare_entry(const void *a, const void *b) {
+  size_t x = ((const symbolic_entry *) a)->key, y = ((const symbolic_entry *) b)->key;
+  return x < y ? -1 : (x > y);
+}
+
+size_t accumulate_symbolic_sparse(sph *data_ph, const PLAN_SCALAR *Z, int m,
+				  const size_t *member, size_t count, size_t offset,
+				  SCALAR *z, int *touched, symbolic_entry *entries) {
+  int d = data_ph->dim, vocab_size = data_ph->vocab_size;
+  size_t t, num_of_touched = 0;
+  int s, j, k;
+  for (t=0; t<count; ++t) {
+    size_t i = member[t];
+    const int *supp = data_ph->p_supp_sym + d*data_ph->p_str_cum[i];
+    const PLAN_SCALAR *xx = Z + m*data_ph->p_str_cum[i];
+    double val;
+    for (s=0; s<data_ph->p_str[i]; ++s)
+      for (j=0; j<m; ++j)
+	if ((val = xx[s*m + j]) > 1E-10) 
+	  for (k=0; k<d; ++k) {
+	    int idx = vocab_size*(d*j + k) + supp[s*d + k];
+	    if (z[idx] == 0) touched[num_of_touched++] = idx;
+	    z[idx] += val;
+	  }
+  }
+  qsort(touched, num_of_touched, sizeof(int), compare_int);
+  for (t=0; t<num_of_touched; ++t) {
+    entries[t].key = offset + touched[t];
+    entries[t].val = z[touched[t]];
+    z[touched[t]] = 0;
+  }
+  return num_of_touched;
+}
+
+size_t reduce_symbolic(size_t count, symbolic_entry *entries) {
+  size_t t, n = 0;
+  if (count == 0) return 0;
+  qsort(entries, count, sizeof(symbolic_entry), compare_entry);
+  for (t=1; t<count; ++t) 
+    if (entries[t].key == entries[n].key) entries[n].val += entries[t].val;
+    else entries[++n] = entries[t];
+  return n + 1;
+}
+
+void minimize_symbolic_sparse(size_t count, const symbolic_entry *entries, int vocab_size,
+			      const SCALAR *dist_mat, int *supp, SCALAR *z_buffer) {
+  size_t a = 0, b;
+  int j, min_idx;
+  double min;
+  while (a < count) {
+    size_t slot = entries[a].key / vocab_size;
+    for (j=0; j<vocab_size; ++j) z_buffer[j] = 0;
+    for (b=a; b<count && entries[b].key / vocab_size == slot; ++b) 
+      _D2_CBLAS_FUNC(axpy)(vocab_size, entries[b].val, dist_mat + (entries[b].key % vocab_size) * vocab_size, 1, z_buffer, 1);
+    min = DBL_MAX; min_idx = 0;
+    for (j=0; j<vocab_size; ++j) 
+      if (z_buffer[j] < min) {min = z_buffer[j]; min_idx = j;}
+    supp[slot] = min_idx;
+    a = b;
+  }
+}
+
+#ifdef __USE_MPI__
+symbolic_entry* reduce_scatter_symbolic(size_t *count, const symbolic_entry *entries,
+					size_t num_of_slots, int vocab_size,
+					int *slot_counts, int *slot_displs) {
+  int *send_counts = _D2_MALLOC_INT(nprocs), *recv_counts = _D2_MALLOC_INT(nprocs), r;
+  size_t t, a, total;
+  MPI_Request *requests = (MPI_Request *) malloc(2 * nprocs * sizeof(MPI_Request));
+  MPI_Datatype entry_type;
+  symbolic_entry *received, *p;
+
+  assert(num_of_slots <= INT_MAX && requests);
+  /* node r owns the supports [slot_displs[r], slot_displs[r] + slot_counts[r]) */
+  for (r=0; r<nprocs; ++r) {
+    slot_displs[r] = (int) (num_of_slots * r / nprocs);
+    slot_counts[r] = (int) (num_of_slots * (r+1) / nprocs) - slot_displs[r];
+  }
+  /* entries are sorted by keys, so those sent to a node are contiguous */
+  for (r=0, t=0; r<nprocs; ++r) {
+    size_t end = (size_t) (slot_displs[r] + slot_counts[r]) * vocab_size;
+    for (a=t; t < *count && entries[t].key < end; ++t);
+    assert(t - a <= INT_MAX);
+    send_counts[r] = (int) (t - a);
+  }
+  MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+  for (r=0, total=0; r<nprocs; ++r) total += recv_counts[r];
+  received = (symbolic_entry *) malloc((total > 0 ? total : 1) * sizeof(symbolic_entry)); assert(received);
+
+  /* counts are in entries, so only a single message to a node is limited by INT_MAX */
+  MPI_Type_contiguous(sizeof(symbolic_entry), MPI_BYTE, &entry_type);
+  MPI_Type_commit(&entry_type);
+  for (r=0, p=received; r<nprocs; p += recv_counts[r++])
+    MPI_Irecv(p, recv_counts[r], entry_type, r, 0, MPI_COMM_WORLD, requests + r);
+  for (r=0, a=0; r<nprocs; a += send_counts[r++])
+    MPI_Isend((void *) (entries + a), send_counts[r], entry_type, r, 0, MPI_COMM_WORLD, requests + nprocs + r);
+  MPI_Waitall(2 * nprocs, requests, MPI_STATUSES_IGNORE);
+  MPI_Type_free(&entry_type);
+
+  *count = reduce_symbolic(total, received);
+  _D2_FREE(send_counts);
+  _D2_FREE(recv_counts);
+  free(requests);
+  return received;
+}
+#endif
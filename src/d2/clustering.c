@@ -18,116 +18,539 @@ const char intro[]="------------------------------------------------------------
 extern int d2_alg_type;
 
 const double time_budget_ratio = 2000.0;
+const double centroid_drift_ratio = 0.1; /* of distances to the nearest centroids, see d2_labeling_prep() */
 double time_budget;
+double tol_scale = 1.; /* of tolerances of the update step, see d2_labeling() */
 double global_startTime;
 
 int d2_alg_type = D2_CENTROID_BADMM;
+int d2_dist_type = D2_DISTANCE_EXACT;
+size_t d2_warmstart_size = 0; /* number of bases cached for warm start, 0 to disable */
+size_t d2_bound_budget = (size_t) 1 << 30; /* bytes of lower bounds of trieq per processor */
+int d2_bound_groups = 0; /* number of lower bounds of trieq per object, 0 for automatic */
+int d2_init_rounds = 0; /* rounds of k-means|| to seed centroids, 0 for random objects */
+int d2_badmm_by_cluster = 0; /* run BADMM of clusters as independent tasks, see d2_centroid_sphBregman() */
+SINKHORN_options sinkhorn_options = {.maxIters = 100, .regCoeff = 0.05, .tol = 1E-6};
+SINKHORN_options *p_sinkhorn_options = &sinkhorn_options;
 int world_rank = 0; 
 int nprocs = 1;
 
+/**
+ * Solve one transportation problem by the selected distance engine:
+ * return the (approximate) cost and write its lower bound to @param(lower)
+ */
+static double match_by_distmat(d2_solver_context *ctx,
+			       int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			       size_t index, __OUT__ double *lower) {
+  double val;
+  if (d2_dist_type == D2_DISTANCE_SINKHORN) {
+    return d2_match_by_sinkhorn(n, m, C, wX, wY,
+				p_sinkhorn_options->regCoeff,
+				p_sinkhorn_options->maxIters,
+				p_sinkhorn_options->tol,
+				lower);
+  }
+  val = d2_match_by_distmat_ctx(ctx, n, m, C, wX, wY, 
+				NULL, // x and lambda are implemented later
+				NULL,
+				index);
+  if (val == D2_SOLVER_ERROR) // bounds of the entropic approximation instead of an exact cost
+    return d2_match_by_sinkhorn(n, m, C, wX, wY,
+				p_sinkhorn_options->regCoeff,
+				p_sinkhorn_options->maxIters,
+				p_sinkhorn_options->tol,
+				lower);
+  *lower = val;
+  return val;
+}
+
+/**
+ * Solve a batch of transportation problems by the selected distance engine,
+ * writing their costs to @param(fval) and lower bounds to @param(lower)
+ */
+static void match_by_distmat_batch(var_mph *var_work, size_t count, d2_match_problem *problems,
+				   __OUT__ double *fval, __OUT__ double *lower) {
+  long k;
+  if (d2_dist_type == D2_DISTANCE_SINKHORN) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (k=0; k<(long) count; ++k)
+      fval[k] = d2_match_by_sinkhorn(problems[k].n, problems[k].m,
+				     problems[k].C, problems[k].wX, problems[k].wY,
+				     p_sinkhorn_options->regCoeff,
+				     p_sinkhorn_options->maxIters,
+				     p_sinkhorn_options->tol,
+				     lower + k);
+    return;
+  }
+  d2_match_by_distmat_batch(var_work->solver_ctx, var_work->num_of_threads,
+			    count, problems, fval);
+  for (k=0; k<(long) count; ++k) 
+    if (fval[k] == D2_SOLVER_ERROR) // see match_by_distmat()
+      fval[k] = d2_match_by_sinkhorn(problems[k].n, problems[k].m,
+				     problems[k].C, problems[k].wX, problems[k].wY,
+				     p_sinkhorn_options->regCoeff,
+				     p_sinkhorn_options->maxIters,
+				     p_sinkhorn_options->tol,
+				     lower + k);
+    else lower[k] = fval[k];
+}
+
+/**
+ * Prepare the transportation cost between the j-th d2 in b and the i-th d2
+ * in a of one phase, and return the matrix to solve with. It is computed in
+ * @param(C) unless it is pre-computed: @param(C_cached) is the cached space
+ * of the i-th d2 (see d2_allocate_work()).
+ */
+static SCALAR* prepare_distmat(sph *a_sph, size_t i, sph *b_sph, size_t j,
+			       SCALAR *C_cached, __OUT__ SCALAR *C) {
+  int dim = a_sph->dim;
+  switch (a_sph->metric_type) {
+  case D2_EUCLIDEAN_L2 :
+    _D2_FUNC(pdist2)(dim, 
+		     b_sph->p_str[j], 
+		     a_sph->p_str[i], 
+		     b_sph->p_supp + b_sph->p_str_cum[j]*dim, 
+		     a_sph->p_supp + a_sph->p_str_cum[i]*dim, 
+		     C);
+    return C;
+  case D2_WORD_EMBED :
+    _D2_FUNC(pdist2_sym)(dim,
+			 b_sph->p_str[j],
+			 a_sph->p_str[i],
+			 b_sph->p_supp + b_sph->p_str_cum[j]*dim,
+			 a_sph->p_supp_sym + a_sph->p_str_cum[i],
+			 C,
+			 a_sph->vocab_vec);
+    return C;
+  case D2_HISTOGRAM :
+    return a_sph->dist_mat;
+  case D2_SPARSE_HISTOGRAM :
+    return C_cached;
+  case D2_N_GRAM : 
+    _D2_FUNC(pdist_symbolic)(dim, 
+			     b_sph->p_str[j], 
+			     a_sph->p_str[i], 
+			     b_sph->p_supp_sym + b_sph->p_str_cum[j]*dim, 
+			     a_sph->p_supp_sym + a_sph->p_str_cum[i]*dim, 
+			     C,
+			     a_sph->vocab_size,
+			     a_sph->dist_mat);
+    return C;
+  }
+  assert(0);
+  return NULL;
+}
+
+/**
+ * Whether the transportation cost of a phase has a closed form: supports
+ * lie on a line under |x-y|^p, which are bins of D2_HISTOGRAM of hist_power
+ * p > 0, or 1-D D2_EUCLIDEAN_L2 supports with p = 2.
+ */
+static char has_quantile(sph *a_sph) {
+  return a_sph->hist_power > 0 || (a_sph->metric_type == D2_EUCLIDEAN_L2 && a_sph->dim == 1);
+}
+
+/* supports on a line in order: a sorted copy is made in @param(buffer) if needed */
+static void sorted_supports(sph *p_sph, size_t i, SCALAR **supp, SCALAR **w, SCALAR **buffer) {
+  int n = p_sph->p_str[i], k;
+  *supp = p_sph->p_supp + p_sph->p_str_cum[i];
+  *w = p_sph->p_w + p_sph->p_str_cum[i];
+  *buffer = NULL;
+  for (k=1; k<n && (*supp)[k-1] <= (*supp)[k]; ++k);
+  if (k >= n) return;
+
+  *buffer = _D2_MALLOC_SCALAR(2*n);
+  memcpy(*buffer, *supp, n * sizeof(SCALAR));
+  memcpy(*buffer + n, *w, n * sizeof(SCALAR));
+  *supp = *buffer; *w = *buffer + n;
+  d2_sort_supports_1d(n, *supp, *w, NULL);
+}
+
+/**
+ * Closed-form transportation cost between the j-th d2 in b and the i-th d2
+ * in a of a phase of has_quantile(), which needs no solver. Objects are
+ * sorted after read and centroids are mostly kept sorted by
+ * d2_centroid_sphBregman(), otherwise a sorted copy is made.
+ */
+static double match_by_quantile(sph *a_sph, size_t i, sph *b_sph, size_t j) {
+  int n = b_sph->p_str[j], m = a_sph->p_str[i];
+  SCALAR *x, *y, *wX, *wY, *x_buffer, *y_buffer;
+  double val;
+
+  if (a_sph->metric_type == D2_HISTOGRAM)
+    return a_sph->hist_scale * d2_match_by_quantile(n, m, NULL, NULL,
+						    b_sph->p_w + b_sph->p_str_cum[j],
+						    a_sph->p_w + a_sph->p_str_cum[i],
+						    a_sph->hist_power);
+
+  sorted_supports(b_sph, j, &x, &wX, &x_buffer);
+  sorted_supports(a_sph, i, &y, &wY, &y_buffer);
+  val = d2_match_by_quantile(n, m, x, y, wX, wY, 2);
+  if (x_buffer) _D2_FREE(x_buffer);
+  if (y_buffer) _D2_FREE(y_buffer);
+  return val;
+}
+
+/* weight of the transportation cost of one phase in the squared distance */
+static double distmat_scale(sph *a_sph) {
+  return a_sph->metric_type == D2_N_GRAM ? 2. / a_sph->dim : 1.;
+}
+
 /**
  * Compute the distance between i-th d2 in a and j-th d2 in b 
  * Return square root of the undergoing cost as distance
  * @param(i) the cached space indicator
+ * @param(index_task) together with j, the key of the basis kept by the solver to warm start
+ * @param(lower) lower bound of the exact distance: the returned distance is
+ * exact with D2_DISTANCE_EXACT, and an upper bound with D2_DISTANCE_SINKHORN.
  */
-double d2_compute_distance(mph *a, size_t i, 
-			   mph *b, size_t j, 
-			   int selected_phase, 
-			   var_mph *var_work, size_t index_task) {
+double d2_compute_distance_bounds(mph *a, size_t i, 
+				  mph *b, size_t j, 
+				  int selected_phase, 
+				  var_mph *var_work, size_t index_task,
+				  __OUT__ double *lower) {
   int n;
-  double d = 0.0, val; assert(a->s_ph == b->s_ph);
+  double d = 0.0, d_lower = 0.0, val, val_lower; assert(a->s_ph == b->s_ph);
+  d2_solver_context *ctx = d2_get_solver_context(var_work);
   for (n=0; n<a->s_ph; ++n) 
     if (selected_phase < 0 || n == selected_phase) {
       sph *a_sph = a->ph + n, *b_sph = b->ph + n;
-      int dim = a->ph[n].dim; assert(dim == b_sph->dim);      
-      size_t index = (selected_phase < 0 ? (index_task * a->s_ph + n) : index_task);
+      size_t index = (selected_phase < 0 ? ((index_task * b->size + j) * a->s_ph + n) : index_task * b->size + j);
       size_t idx = b_sph->p_str[j] * a_sph->p_str_cum[i];
-      switch (a_sph->metric_type) {
-      case D2_EUCLIDEAN_L2 :
-	_D2_FUNC(pdist2)(dim, 
-			 b_sph->p_str[j], 
-			 a_sph->p_str[i], 
-			 b_sph->p_supp + b_sph->p_str_cum[j]*dim, 
-			 a_sph->p_supp + a_sph->p_str_cum[i]*dim, 
-			 var_work->g_var[n].C + idx);
-	val = d2_match_by_distmat(b_sph->p_str[j], 
-				  a_sph->p_str[i], 				  
-				  var_work->g_var[n].C + idx,
-				  b_sph->p_w + b_sph->p_str_cum[j], 
-				  a_sph->p_w + a_sph->p_str_cum[i], 
-				  NULL, // x and lambda are implemented later
-				  NULL,
-				  index);
-	d += val;
-	break;
-      case D2_WORD_EMBED :
-	_D2_FUNC(pdist2_sym)(dim,
-			     b_sph->p_str[j],
-			     a_sph->p_str[i],
-			     b_sph->p_supp + b_sph->p_str_cum[j]*dim,
-			     a_sph->p_supp_sym + a_sph->p_str_cum[i],
-			     var_work->g_var[n].C + idx,
-			     a_sph->vocab_vec);
-	val = d2_match_by_distmat(b_sph->p_str[j], 
-				  a_sph->p_str[i], 				  
-				  var_work->g_var[n].C + idx,
-				  b_sph->p_w + b_sph->p_str_cum[j], 
-				  a_sph->p_w + a_sph->p_str_cum[i], 
-				  NULL, // x and lambda are implemented later
-				  NULL,
-				  index);
-	d += val;
-	break;
-      case D2_HISTOGRAM :
-	val = d2_match_by_distmat(b_sph->p_str[j],
-				  a_sph->p_str[i], 				   
-				  a_sph->dist_mat, 
-				  b_sph->p_w + b_sph->p_str_cum[j], 
-				  a_sph->p_w + a_sph->p_str_cum[i], 
-				  NULL, NULL,
-				  index);
-	d += val;
-	break;
-      case D2_SPARSE_HISTOGRAM :
-	val = d2_match_by_distmat(b_sph->p_str[j],
-				  a_sph->p_str[i],
-				  var_work->g_var[n].C + idx,
-				  b_sph->p_w + b_sph->p_str_cum[j],
-				  a_sph->p_w + a_sph->p_str_cum[i],
-				  NULL,
-				  NULL,
-				  index);
-	d += val;
-	break;
-      case D2_N_GRAM : 
-	_D2_FUNC(pdist_symbolic)(dim, 
-				 b_sph->p_str[j], 
-				 a_sph->p_str[i], 
-				 b_sph->p_supp_sym + b_sph->p_str_cum[j]*dim, 
-				 a_sph->p_supp_sym + a_sph->p_str_cum[i]*dim, 
-				 var_work->g_var[n].C + idx,
-				 a_sph->vocab_size,
-				 a_sph->dist_mat);
-
-	val = d2_match_by_distmat(b_sph->p_str[j], 
-				  a_sph->p_str[i], 
-				  var_work->g_var[n].C + idx,
-				  b_sph->p_w + b_sph->p_str_cum[j], 
-				  a_sph->p_w + a_sph->p_str_cum[i], 
-				  NULL, // x and lambda are implemented later
-				  NULL,
-				  index) / dim;
-
-	d += 2*val;	
-	break;
+      SCALAR *C;
+      assert(a_sph->dim == b_sph->dim);
+
+      if (has_quantile(a_sph)) {
+	val = val_lower = match_by_quantile(a_sph, i, b_sph, j);
+      } else {
+	C = prepare_distmat(a_sph, i, b_sph, j, 
+			    var_work->g_var[n].C + idx, var_work->g_var[n].C + idx);
+	val = match_by_distmat(ctx, b_sph->p_str[j], 
+			       a_sph->p_str[i], 
+			       C,
+			       b_sph->p_w + b_sph->p_str_cum[j], 
+			       a_sph->p_w + a_sph->p_str_cum[i], 
+			       index, &val_lower);
       }
+      d += distmat_scale(a_sph) * val;
+      d_lower += distmat_scale(a_sph) * val_lower;
     }
 
+  *lower = d_lower <= 0 ? 0. : sqrt(d_lower);
   if (d <= 0) return 0.;
   return sqrt(d);
 }
 
+double d2_compute_distance(mph *a, size_t i, 
+			   mph *b, size_t j, 
+			   int selected_phase, 
+			   var_mph *var_work, size_t index_task) {
+  double lower;
+  return d2_compute_distance_bounds(a, i, b, j, selected_phase, var_work, index_task, &lower);
+}
+
+/**
+ * Cost matrices of a chunk of problems whose centroids have supports of
+ * the same size, computed across problems, see _D2_FUNC(pdist2_batch).
+ * Return false if the metric or the supports need one problem at a time.
+ */
+static char prepare_distmat_batch(sph *a_sph, size_t i, sph *b_sph, const size_t *js, size_t count,
+				  size_t sz, __OUT__ SCALAR *C) {
+  const int dim = a_sph->dim, n = b_sph->p_str[js[0]];
+  SCALAR **A;
+  size_t k;
+  if (count < 2 || (a_sph->metric_type != D2_EUCLIDEAN_L2 && a_sph->metric_type != D2_WORD_EMBED))
+    return false;
+  for (k=1; k<count; ++k) if (b_sph->p_str[js[k]] != n) return false;
+
+  A = (SCALAR **) malloc(count * sizeof(SCALAR *)); assert(A);
+  for (k=0; k<count; ++k) A[k] = b_sph->p_supp + b_sph->p_str_cum[js[k]]*dim;
+  if (a_sph->metric_type == D2_EUCLIDEAN_L2)
+    _D2_FUNC(pdist2_batch)(dim, n, a_sph->p_str[i], count, A,
+			   a_sph->p_supp + a_sph->p_str_cum[i]*dim, C, sz);
+  else
+    _D2_FUNC(pdist2_sym_batch)(dim, n, a_sph->p_str[i], count, A,
+			       a_sph->p_supp_sym + a_sph->p_str_cum[i], C, sz,
+			       a_sph->vocab_vec);
+  free(A);
+  return true;
+}
+
+/**
+ * Prepare the transportation problems between the i-th d2 in a and the d2s
+ * in b indexed by @param(js): the problem of js[k] in phase n is kept in
+ * var_work->g_var[n].batch[k], whose cost matrix is computed in the k-th
+ * block of the batch space, so that @param(count) should be no more than
+ * var_work->batch_size, see d2_compute_distance_bounds_batch() otherwise.
+ */
+void d2_prepare_distance_batch(mph *a, size_t i,
+			       mph *b, const size_t *js, size_t count,
+			       int selected_phase,
+			       var_mph *var_work, size_t index_task) {
+  int n;
+  size_t k;
+  assert(a->s_ph == b->s_ph && count <= var_work->batch_size);
+
+  for (n=0; n<a->s_ph; ++n)
+    if (selected_phase < 0 || n == selected_phase) {
+      sph *a_sph = a->ph + n, *b_sph = b->ph + n;
+      size_t index = (selected_phase < 0 ? index_task * b->size * a->s_ph + n : index_task * b->size);
+      SCALAR *C_cached = var_work->g_var[n].C + b_sph->str * a_sph->p_str_cum[i];
+      SCALAR *C_batch = var_work->g_var[n].C_batch;
+      size_t sz = var_work->g_var[n].batch_stride;
+      char batched = !has_quantile(a_sph) && count > 0 &&
+	prepare_distmat_batch(a_sph, i, b_sph, js, count, sz, C_batch);
+      assert(a_sph->dim == b_sph->dim && a_sph->p_str[i] * b_sph->str <= (long) sz);
+
+      for (k=0; k<count; ++k) {
+	size_t j = js[k];
+	d2_match_problem *p = var_work->g_var[n].batch + k;
+	p->n = b_sph->p_str[j];
+	p->m = a_sph->p_str[i];
+	p->C = has_quantile(a_sph) ? NULL : // computed by match_by_quantile()
+	  batched ? C_batch + k*sz :
+	  prepare_distmat(a_sph, i, b_sph, j, C_cached, C_batch ? C_batch + k*sz : NULL);
+	p->wX = b_sph->p_w + b_sph->p_str_cum[j];
+	p->wY = a_sph->p_w + a_sph->p_str_cum[i];
+	p->index = index + j * (selected_phase < 0 ? a->s_ph : 1);
+      }
+    }
+}
+
+/**
+ * Compute the distances of the problems prepared by d2_prepare_distance_batch()
+ * for the d2s in b indexed by @param(js): the problem of js[k] is the
+ * (js[k] - @param(first))-th prepared one if first >= 0, or else the k-th.
+ */
+static void compute_prepared_distances(mph *a, size_t i,
+				       mph *b, const size_t *js, size_t count, long first,
+				       int selected_phase, var_mph *var_work,
+				       __OUT__ double *d, __OUT__ double *lower) {
+  int n;
+  size_t k;
+  d2_match_problem *problems = var_work->batch;
+  double *val = var_work->batch_val, *val_lower = val + count;
+
+  for (k=0; k<count; ++k) {d[k] = 0.; lower[k] = 0.;}
+  for (n=0; n<a->s_ph; ++n)
+    if (selected_phase < 0 || n == selected_phase) {
+      if (has_quantile(a->ph + n)) {
+	for (k=0; k<count; ++k)
+	  val[k] = val_lower[k] = match_by_quantile(a->ph + n, i, b->ph + n, js[k]);
+      } else {
+	for (k=0; k<count; ++k) problems[k] = var_work->g_var[n].batch[first < 0 ? k : js[k] - first];
+	match_by_distmat_batch(var_work, count, problems, val, val_lower);
+      }
+
+      for (k=0; k<count; ++k) {
+	d[k] += distmat_scale(a->ph + n) * val[k];
+	lower[k] += distmat_scale(a->ph + n) * val_lower[k];
+      }
+    }
+
+  for (k=0; k<count; ++k) {
+    lower[k] = lower[k] <= 0 ? 0. : sqrt(lower[k]);
+    d[k] = d[k] <= 0 ? 0. : sqrt(d[k]);
+  }
+}
+
+/**
+ * Compute the distances of the problems prepared by d2_prepare_distance_batch()
+ * of the same @param(a, i, b, js) as d2_compute_distance_bounds() does, while
+ * the problems of each phase are sent to the solver in one batch.
+ */
+void d2_compute_prepared_distance_batch(mph *a, size_t i,
+					mph *b, const size_t *js, size_t count,
+					int selected_phase, var_mph *var_work,
+					__OUT__ double *d, __OUT__ double *lower) {
+  compute_prepared_distances(a, i, b, js, count, -1, selected_phase, var_work, d, lower);
+}
+
+/**
+ * Compute the distances between the i-th d2 in a and the d2s in b indexed
+ * by @param(js), chunk by chunk of var_work->batch_size problems, see
+ * d2_prepare_distance_batch().
+ */
+void d2_compute_distance_bounds_batch(mph *a, size_t i,
+				      mph *b, const size_t *js, size_t count,
+				      int selected_phase,
+				      var_mph *var_work, size_t index_task,
+				      __OUT__ double *d, __OUT__ double *lower) {
+  size_t k, chunk;
+  for (k=0; k<count; k+=chunk) {
+    chunk = count - k < var_work->batch_size ? count - k : var_work->batch_size;
+    d2_prepare_distance_batch(a, i, b, js + k, chunk, selected_phase, var_work, index_task);
+    d2_compute_prepared_distance_batch(a, i, b, js + k, chunk, selected_phase, var_work, d + k, lower + k);
+  }
+}
+
+
+
+/**
+ * Compute the weighted means of supports of centroids in var_work: they
+ * are placed after those of objects computed in d2_allocate_work().
+ */
+static void update_centroid_means(mph *p_data, mph *centroids, int selected_phase, var_mph *var_work) {
+  int n;
+  for (n=0; n<p_data->s_ph; ++n)
+    if ((selected_phase < 0 || n == selected_phase) && var_work->g_var[n].mean)
+      d2_compute_means(centroids->ph + n, centroids->size,
+		       var_work->g_var[n].mean + p_data->size * p_data->ph[n].dim);
+}
+
+/**
+ * Relaxed transportation cost (Kusner et al., ICML 2015): dropping either
+ * side of the marginal constraints lets each support move to its nearest
+ * counterpart, and the larger of the two relaxed costs is a lower bound.
+ */
+static double relaxed_match_by_distmat(const d2_match_problem *p) {
+  int r, c;
+  double row = 0., col = 0.;
+  for (r=0; r<p->n; ++r) {
+    double cmin = DBL_MAX;
+    for (c=0; c<p->m; ++c) if (p->C[r + c*p->n] < cmin) cmin = p->C[r + c*p->n];
+    row += p->wX[r] * cmin;
+  }
+  for (c=0; c<p->m; ++c) {
+    const SCALAR *Cc = p->C + c*p->n;
+    double cmin = DBL_MAX;
+    for (r=0; r<p->n; ++r) if (Cc[r] < cmin) cmin = Cc[r];
+    col += p->wY[c] * cmin;
+  }
+  return row > col ? row : col;
+}
+
+/**
+ * Lower bound of the distance between the i-th object and the j-th centroid:
+ * for D2_EUCLIDEAN_L2 and D2_WORD_EMBED, the transportation cost under the
+ * squared Euclidean metric is no less than the squared distance between
+ * the weighted means of supports, and the other phases contribute zero.
+ * If the problem of the pair is the @param(k)-th one prepared by
+ * d2_prepare_distance_batch(), k >= 0, the relaxed cost of D2_WORD_EMBED
+ * phases is also taken.
+ */
+static double distance_lower_bound(mph *p_data, size_t i, size_t j, int selected_phase,
+				   var_mph *var_work, long k) {
+  int n, d;
+  double d2 = 0.;
+  for (n=0; n<p_data->s_ph; ++n)
+    if (selected_phase < 0 || n == selected_phase) {
+      double val = 0.;
+      if (var_work->g_var[n].mean) {
+	const int dim = p_data->ph[n].dim;
+	const SCALAR *mu_a = var_work->g_var[n].mean + i*dim;
+	const SCALAR *mu_b = var_work->g_var[n].mean + (p_data->size + j)*dim;
+	for (d=0; d<dim; ++d) val += (mu_a[d] - mu_b[d]) * (mu_a[d] - mu_b[d]);
+      }
+      if (k >= 0 && p_data->ph[n].metric_type == D2_WORD_EMBED) {
+	double r = relaxed_match_by_distmat(var_work->g_var[n].batch + k);
+	if (r > val) val = r;
+      }
+      d2 += val;
+    }
+  return sqrt(d2);
+}
+
+/**
+ * Lower bounds @param(L) of the distances between the i-th object and all
+ * centroids by distance_lower_bound(). With @param(relaxed), the problems
+ * are prepared chunk by chunk for their relaxed costs, which uses
+ * var_work->batch_idx, and the chunk of the @param(last) centroid is
+ * prepared last. Return the first centroid of the chunk left prepared, or
+ * centroids->size if none is.
+ */
+static size_t distance_lower_bounds(mph *p_data, size_t i, mph *centroids, int selected_phase,
+				    var_mph *var_work, char relaxed, size_t last, __OUT__ double *L) {
+  const size_t size = centroids->size, batch_size = var_work->batch_size;
+  const size_t num_of_chunks = (size + batch_size - 1) / batch_size, last_chunk = last / batch_size;
+  size_t j, k, t, chunk, *js = var_work->batch_idx;
+  if (!relaxed) {
+    for (j=0; j<size; ++j)
+      L[j] = distance_lower_bound(p_data, i, j, selected_phase, var_work, -1);
+    return size;
+  }
+  assert(last < size);
+  for (t=0, j=size; t<num_of_chunks; ++t) {
+    /* chunks in order with that of the last centroid moved to the end */
+    j = (t + 1 == num_of_chunks ? last_chunk : t < last_chunk ? t : t + 1) * batch_size;
+    chunk = size - j < batch_size ? size - j : batch_size;
+    for (k=0; k<chunk; ++k) js[k] = j + k;
+    d2_prepare_distance_batch(p_data, i, centroids, js, chunk, selected_phase, var_work, i);
+    for (k=0; k<chunk; ++k)
+      L[j+k] = distance_lower_bound(p_data, i, j+k, selected_phase, var_work, k);
+  }
+  return j;
+}
+
+/* relaxed costs of D2_WORD_EMBED need the cost matrices to all centroids */
+static char use_relaxed(mph *p_data, int selected_phase) {
+  int n;
+  for (n=0; n<p_data->s_ph; ++n)
+    if ((selected_phase < 0 || n == selected_phase) && p_data->ph[n].metric_type == D2_WORD_EMBED) 
+      return true;
+  return false;
+}
+
+/**
+ * Find the nearest centroid of the i-th object, and write its distance to
+ * @param(distance). Centroids are solved in batches, only those whose lower
+ * bounds beat the distance to the current label. Optionally, a lower bound
+ * of the distances to the other centroids is written to @param(second), and
+ * the number of distances computed is added to @param(dist_count).
+ */
+static size_t nearest_centroid(mph *p_data, size_t i, mph *centroids,
+			       int selected_phase, var_mph *var_work, char relaxed,
+			       __OUT__ double *distance, __OUT__ double *second,
+			       __OUT__ size_t *dist_count) {
+  int *label = p_data->label;
+  double *dist = var_work->batch_dist, *dist_lower = dist + centroids->size;
+  double *L = dist_lower + centroids->size;
+  double min_distance, d_lower;
+  size_t jj = label[i]>=0? (size_t) label[i]: centroids->size - 1;
+  size_t j, first, num_of_prepared = 0, num_of_candidates = 0, *js = var_work->batch_idx;
+
+  /**
+   * start from the current label, or else the centroid of the least lower
+   * bound: problems of the chunk left prepared for relaxed bounds, from
+   * @param(first), are solved as they are.
+   */
+  first = distance_lower_bounds(p_data, i, centroids, selected_phase, var_work, relaxed, jj, L);
+  if (label[i] < 0)
+    for (j=0, jj=0; j<centroids->size; ++j) if (L[j] < L[jj]) jj = j;
+  if (jj >= first)
+    compute_prepared_distances(p_data, i, centroids, &jj, 1, first, selected_phase, var_work, &min_distance, &d_lower);
+  else {
+    d2_compute_distance_bounds_batch(p_data, i, centroids, &jj, 1, selected_phase, var_work, i, &min_distance, &d_lower);
+    first = centroids->size; // overwritten
+  }
+  if (d_lower > L[jj]) L[jj] = d_lower;
+
+  /* only centroids whose lower bounds beat the current best need to be solved, prepared ones first */
+  for (j=first; j<centroids->size && j<first + var_work->batch_size; ++j)
+    if (j != jj && L[j] <= min_distance) js[num_of_prepared++] = j;
+  compute_prepared_distances(p_data, i, centroids, js, num_of_prepared, first, selected_phase, var_work, dist, dist_lower);
+  num_of_candidates = num_of_prepared;
+  for (j=0; j<centroids->size; ++j)
+    if (j != jj && L[j] <= min_distance && (j < first || j >= first + var_work->batch_size)) js[num_of_candidates++] = j;
+  d2_compute_distance_bounds_batch(p_data, i, centroids, js + num_of_prepared, num_of_candidates - num_of_prepared,
+				   selected_phase, var_work, i, dist + num_of_prepared, dist_lower + num_of_prepared);
+  for (j=0; j<num_of_candidates; ++j) {
+    if (dist_lower[j] > L[js[j]]) L[js[j]] = dist_lower[j];
+    if (dist[j] < min_distance || (dist[j] == min_distance && js[j] < jj)) {
+      min_distance = dist[j]; jj = js[j];
+    }
+  }
 
+  *distance = min_distance;
+  if (second) {
+    *second = DBL_MAX;
+    for (j=0; j<centroids->size; ++j) if (j != jj && L[j] < *second) *second = L[j];
+  }
+  if (dist_count) *dist_count += 1 + num_of_candidates;
+  return jj;
+}
 
 /**
  * See the paper for detailed algorithm description: 
@@ -135,61 +558,57 @@ double d2_compute_distance(mph *a, size_t i,
  */
 
 /**
- * Compute the distance from each point to the all centroids.
- * This part can be parallelized.
+ * Relabeling with Elkan's bounds: tr.l[i*k + j] bounds the distance from
+ * the i-th object to the j-th centroid from below.
  */
-size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
-		      mph *centroids,
-		      var_mph * var_work,
-		      int selected_phase) {
+static size_t labeling_prep_elkan(mph *p_data, mph *centroids,
+				  var_mph *var_work, int selected_phase,
+				  __OUT__ size_t *p_dist_count) {
   size_t i, count = 0, dist_count = 0;
   const size_t size = p_data->size;
   const size_t num_of_labels = centroids->size;
   int *label = p_data->label;
-  double startTime;
   trieq *p_tr = &var_work->tr;
 
-  startTime = getRealTime();
-  /* step 1 */
-  for (i=0; i<num_of_labels; ++i) p_tr->s[i] = DBL_MAX;
-  for (i=0; i<num_of_labels * num_of_labels; ++i) p_tr->c[i] = 0;
-
-  /* pre-compute pairwise distance between centroids */
-  for (i=0; i<num_of_labels; ++i) 
-    if (world_rank == i % nprocs) {
+  /* tighten lower bounds by the means of supports, which prune from the first round */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(var_work->num_of_threads)
+#endif
+  for (i=0; i<size; ++i) {
+    SCALAR *L = p_tr->l + i*num_of_labels;
     size_t j;
-
-    for (j=i+1; j<num_of_labels; ++j) {
-      double d;
-      d = d2_compute_distance(centroids, i, centroids, j, selected_phase, var_work, p_data->size + i); 
-      dist_count +=1;
-      p_tr->c[i*num_of_labels + j] = d; 
-      p_tr->c[i + j*num_of_labels] = d;
-
-      if (p_tr->s[i] > d / 2.f) p_tr->s[i] = d / 2.f;
-      if (p_tr->s[j] > d / 2.f) p_tr->s[j] = d / 2.f;
-    }    
+    for (j=0; j<num_of_labels; ++j) {
+      double d = distance_lower_bound(p_data, i, j, selected_phase, var_work, -1);
+      if (d > L[j]) L[j] = d;
     }
-#ifdef __USE_MPI__
-    MPI_Allreduce(MPI_IN_PLACE, p_tr->c, num_of_labels*num_of_labels, MPI_SCALAR, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, p_tr->s, num_of_labels, MPI_SCALAR, MPI_MIN, MPI_COMM_WORLD);
-#endif
-
-  /* initialization */
-  for (i=0; i<size; ++i) 
-    if (d2_alg_type == D2_CENTROID_BADMM)
-      { var_work->label_switch[i] = 0; }
+  }
 
-  for (i=0; i<size; ++i) {
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads) reduction(+:count,dist_count)
+#endif
+  {
+  var_mph thread_work;
+  var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+  long i;
+  d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+  for (i=0; i<(long) size; ++i) {
   /* step 2 */
   if (label[i]<0 || p_tr->u[i] > p_tr->s[label[i]]) {
     int init_label = label[i];
-    int jj = init_label>=0? init_label: 0;
-    int j;
+    size_t jj = init_label>=0? init_label: 0;
+    size_t j;
     SCALAR min_distance;
     SCALAR *U = p_tr->u + i;
     SCALAR *L = p_tr->l + i*num_of_labels;
 
+    /* start an unlabeled object from the centroid of the least lower bound */
+    if (init_label < 0)
+      for (j=1; j<num_of_labels; ++j) if (L[j] < L[jj]) jj = j;
+
     /* step 3 */
     for (j=0; j<num_of_labels; ++j) 
       if ((j != jj || init_label < 0) && *U > L[j] && *U > p_tr->c[j*num_of_labels + jj] / 2.) {
@@ -197,10 +616,10 @@ size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
 	/* 3a. */
 	if (p_tr->r[i] == 1) {
 	  /* compute distance */
-	  double d;
-	  d = d2_compute_distance(p_data, i, centroids, jj, selected_phase, var_work, i);
+	  double d, d_lower;
+	  d = d2_compute_distance_bounds(p_data, i, centroids, jj, selected_phase, &thread_work, i, &d_lower);
 	  dist_count +=1;
-	  L[jj] = d;
+	  L[jj] = d_lower;
 	  *U = d;
 	  min_distance = d;
 	  p_tr->r[i] = 0;
@@ -211,15 +630,15 @@ size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
 	/* 3b. */
 	if ((min_distance > L[j] || min_distance > p_tr->c[j*num_of_labels + jj] / 2.) && j!=jj) {
 	  /* compute distance */
-	  double d;
-	  d = d2_compute_distance(p_data, i, centroids, j, selected_phase, var_work, i);
+	  double d, d_lower;
+	  d = d2_compute_distance_bounds(p_data, i, centroids, j, selected_phase, &thread_work, i, &d_lower);
 	  dist_count +=1;
-	  L[j] = d;
+	  L[j] = d_lower;
 	  if (d < min_distance) {jj = j; min_distance = d; *U = d;}
 	}
       }
     
-    if (jj != init_label) {
+    if ((int) jj != init_label) {
       label[i] = jj;
       if (d2_alg_type == D2_CENTROID_BADMM) 
 	{ var_work->label_switch[i] = 1;}
@@ -227,6 +646,341 @@ size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
     }
   }
   }
+  free(g_var);
+  }
+
+  *p_dist_count += dist_count;
+  return count;
+}
+
+/**
+ * Relabeling with one lower bound per object (Hamerly, SDM 2010), which is
+ * used in place of Elkan's bounds of d2_labeling_prep() when the latter
+ * exceed the memory budget: tr.l[i] bounds the distances from the i-th
+ * object to all centroids but its own from below, and the object keeps its
+ * label if tr.u[i] is within max(tr.l[i], tr.s[label]). Otherwise all
+ * centroids are searched by nearest_centroid().
+ */
+static size_t labeling_prep_single_bound(mph *p_data, mph *centroids,
+					 var_mph *var_work, int selected_phase,
+					 __OUT__ size_t *p_dist_count) {
+  int *label = p_data->label;
+  trieq *p_tr = &var_work->tr;
+  char relaxed = use_relaxed(p_data, selected_phase);
+  size_t count = 0, dist_count = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads) reduction(+:count,dist_count)
+#endif
+  {
+    var_mph thread_work;
+    var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+    long i;
+    d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (i=0; i<(long) p_data->size; ++i) {
+      int init_label = label[i];
+      SCALAR *U = p_tr->u + i, *L = p_tr->l + i;
+      double d, second;
+      size_t jj;
+
+      if (init_label >= 0) {
+	/* bounds are kept in O(1) per object, see d2_labeling_post() */
+	double m = *L > p_tr->s[init_label] ? *L : p_tr->s[init_label];
+	if (*U <= m) continue;
+	if (p_tr->r[i] == 1) {
+	  double d_lower;
+	  *U = d2_compute_distance_bounds(p_data, i, centroids, init_label, selected_phase, &thread_work, i, &d_lower);
+	  dist_count += 1;
+	  p_tr->r[i] = 0;
+	  if (*U <= m) continue;
+	}
+      }
+
+      jj = nearest_centroid(p_data, i, centroids, selected_phase, &thread_work, relaxed,
+			    &d, &second, &dist_count);
+      *U = d; *L = second;
+      p_tr->r[i] = 0;
+      if ((int) jj != init_label) {
+	label[i] = jj;
+	if (d2_alg_type == D2_CENTROID_BADMM) 
+	  { var_work->label_switch[i] = 1;}
+	count += 1;
+      }
+    }
+    free(g_var);
+  }
+
+  *p_dist_count += dist_count;
+  return count;
+}
+
+/**
+ * Split centroids into @param(num_of_groups) groups by their pairwise
+ * distances @param(c): seeds are chosen by the farthest-first traversal,
+ * and then refined by a few rounds of k-medoids.
+ */
+static void group_centroids(const SCALAR *c, int num_of_labels, int num_of_groups,
+			    __OUT__ int *group) {
+  int *medoid = _D2_MALLOC_INT(num_of_groups);
+  SCALAR *dmin = _D2_MALLOC_SCALAR(num_of_labels);
+  int i, j, g, iter;
+
+  medoid[0] = 0;
+  for (j=0; j<num_of_labels; ++j) dmin[j] = c[j];
+  for (g=1; g<num_of_groups; ++g) {
+    int far = 0;
+    for (j=1; j<num_of_labels; ++j) if (dmin[j] > dmin[far]) far = j;
+    medoid[g] = far;
+    for (j=0; j<num_of_labels; ++j) 
+      if (c[far*num_of_labels + j] < dmin[j]) dmin[j] = c[far*num_of_labels + j];
+  }
+
+  for (iter=0; iter<5; ++iter) {
+    char changed = false;
+    for (j=0; j<num_of_labels; ++j) {
+      int gg = 0;
+      for (g=1; g<num_of_groups; ++g) 
+	if (c[medoid[g]*num_of_labels + j] < c[medoid[gg]*num_of_labels + j]) gg = g;
+      if (group[j] != gg) {group[j] = gg; changed = true;}
+    }
+    if (!changed) break;
+    for (g=0; g<num_of_groups; ++g) {
+      double min_sum = DBL_MAX;
+      for (i=0; i<num_of_labels; ++i) 
+	if (group[i] == g) {
+	  double sum = 0;
+	  for (j=0; j<num_of_labels; ++j) if (group[j] == g) sum += c[i*num_of_labels + j];
+	  if (sum < min_sum) {min_sum = sum; medoid[g] = i;}
+	}
+    }
+  }
+
+  _D2_FREE(medoid);
+  _D2_FREE(dmin);
+}
+
+/**
+ * Relabeling with one lower bound per group of centroids (Yinyang k-means,
+ * Ding et al., ICML 2015): tr.l[i*G + g] bounds the distances from the
+ * i-th object to the centroids of the g-th group but its own label from
+ * below. The global filter keeps the label as in Hamerly's, and otherwise
+ * only the groups whose bounds beat the distance to the current label are
+ * searched, where a centroid is skipped if its bound from the group, the
+ * distance between centroids, the means of supports or the relaxed cost
+ * (D2_WORD_EMBED) does not beat the current best.
+ */
+static size_t labeling_prep_yinyang(mph *p_data, mph *centroids,
+				    var_mph *var_work, int selected_phase,
+				    __OUT__ size_t *p_dist_count) {
+  const size_t num_of_labels = centroids->size;
+  const int num_of_groups = var_work->tr.num_of_bounds;
+  int *label = p_data->label;
+  trieq *p_tr = &var_work->tr;
+  const int *group = p_tr->group;
+  char relaxed = use_relaxed(p_data, selected_phase);
+  size_t count = 0, dist_count = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads) reduction(+:count,dist_count)
+#endif
+  {
+    var_mph thread_work;
+    var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+    long i;
+    d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (i=0; i<(long) p_data->size; ++i) {
+      int init_label = label[i], g;
+      SCALAR *U = p_tr->u + i, *L = p_tr->l + i*num_of_groups;
+      double *L_new = thread_work.batch_dist, *L_relaxed = L_new + 2*num_of_labels;
+      double d, d_lower, m, min_distance, best_lower;
+      size_t j, jj, first;
+
+      if (init_label < 0) {
+	/* bounds of groups from those of centroids found by nearest_centroid() */
+	const double *L_centroid = thread_work.batch_dist + 2*num_of_labels;
+	jj = nearest_centroid(p_data, i, centroids, selected_phase, &thread_work, relaxed,
+			      &d, NULL, &dist_count);
+	for (g=0; g<num_of_groups; ++g) L[g] = DBL_MAX;
+	for (j=0; j<num_of_labels; ++j) 
+	  if (j != jj && L_centroid[j] < L[group[j]]) L[group[j]] = L_centroid[j];
+	*U = d;
+	p_tr->r[i] = 0;
+	label[i] = jj;
+	if (d2_alg_type == D2_CENTROID_BADMM) 
+	  { var_work->label_switch[i] = 1;}
+	count += 1;
+	continue;
+      }
+
+      /* global filter */
+      for (g=0, m=p_tr->s[init_label]; g<num_of_groups; ++g) if (L[g] < m) m = L[g];
+      if (*U <= m) continue;
+      best_lower = 0;
+      if (p_tr->r[i] == 1) {
+	*U = d2_compute_distance_bounds(p_data, i, centroids, init_label, selected_phase, &thread_work, i, &best_lower);
+	dist_count += 1;
+	p_tr->r[i] = 0;
+	if (*U <= m) continue;
+      }
+
+      /* group filter and local filter */
+      first = relaxed ? distance_lower_bounds(p_data, i, centroids, selected_phase, &thread_work, true, init_label, L_relaxed) :
+	num_of_labels;
+      for (g=0; g<num_of_groups; ++g) L_new[g] = L[g] < *U ? DBL_MAX : L[g];
+      min_distance = *U; jj = init_label;
+      for (j=0; j<num_of_labels; ++j) {
+	double lb;
+	g = group[j];
+	if (j == (size_t) init_label || L[g] >= *U) continue;
+	lb = p_tr->c[init_label*num_of_labels + j] - *U;
+	if (L[g] > lb) lb = L[g];
+	if (lb < min_distance) {
+	  double lb_mean = relaxed ? L_relaxed[j] :
+	    distance_lower_bound(p_data, i, j, selected_phase, &thread_work, -1);
+	  if (lb_mean > lb) lb = lb_mean;
+	}
+	if (lb < min_distance) {
+	  if (j >= first && j < first + thread_work.batch_size) // prepared for relaxed bounds
+	    compute_prepared_distances(p_data, i, centroids, &j, 1, first, selected_phase, &thread_work, &d, &d_lower);
+	  else
+	    d = d2_compute_distance_bounds(p_data, i, centroids, j, selected_phase, &thread_work, i, &d_lower);
+	  dist_count += 1;
+	  lb = d_lower;
+	  if (d < min_distance) {
+	    /* the previous best joins the bound of its group */
+	    if (best_lower < L_new[group[jj]]) L_new[group[jj]] = best_lower;
+	    min_distance = d; best_lower = d_lower; jj = j;
+	    continue;
+	  }
+	}
+	if (lb < L_new[g]) L_new[g] = lb;
+      }
+      for (g=0; g<num_of_groups; ++g) L[g] = L_new[g];
+      *U = min_distance;
+
+      if ((int) jj != init_label) {
+	label[i] = jj;
+	if (d2_alg_type == D2_CENTROID_BADMM) 
+	  { var_work->label_switch[i] = 1;}
+	count += 1;
+      }
+    }
+    free(g_var);
+  }
+
+  *p_dist_count += dist_count;
+  return count;
+}
+
+/**
+ * Scale of tolerances of the update step after labels of @param(count) out of
+ * @param(global_size) objects change: 10 when 10% or more change down to 1
+ * when 1% or less change, so centroids get tighter as clusters settle.
+ */
+static double tolerance_scale(size_t count, size_t global_size) {
+  double scale = 100. * count / global_size;
+  return scale < 1. ? 1. : (scale > 10. ? 10. : scale);
+}
+
+/**
+ * Compute the distance from each point to the all centroids.
+ * Rows of centroid pairs are split over processors and then threads, and
+ * objects are distributed over threads dynamically, since most of them are
+ * pruned while a few need many exact distances. Each thread works on its
+ * own view of var_work (see d2_thread_work()).
+ * The distances of a centroid to the others are recomputed only after it
+ * drifts by more than centroid_drift_ratio of the distance to its nearest
+ * since they were computed, and otherwise their bounds are loosened by the
+ * drifts in d2_labeling_post().
+ */
+size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
+		      mph *centroids,
+		      var_mph * var_work,
+		      int selected_phase) {
+  size_t i, count = 0, dist_count = 0;
+  const size_t size = p_data->size;
+  const size_t num_of_labels = centroids->size;
+  double startTime;
+  trieq *p_tr = &var_work->tr;
+  char *recompute;
+
+  startTime = getRealTime();
+  /* step 1: pairs of centroids that drifted little keep the bounds of
+   * d2_labeling_post(), and the others are computed */
+  recompute = (char *) malloc(num_of_labels * sizeof(char));
+  for (i=0; i<num_of_labels; ++i) 
+    recompute[i] = p_tr->drift[i] < 0 || p_tr->drift[i] > centroid_drift_ratio * 2 * p_tr->s[i];
+  for (i=0; i<num_of_labels * num_of_labels; ++i) 
+    if (recompute[i / num_of_labels] || recompute[i % num_of_labels]) p_tr->c[i] = 0;
+
+  /* pre-compute pairwise distance between centroids */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads) reduction(+:dist_count)
+#endif
+  {
+    var_mph thread_work;
+    var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+    long i;
+    d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (i=0; i<(long) num_of_labels; ++i) 
+      if (world_rank == i % nprocs) {
+	size_t j, num_of_pairs = 0, *js = thread_work.batch_idx;
+	double *dist = thread_work.batch_dist, *dist_lower = dist + num_of_labels;
+
+	for (j=i+1; j<num_of_labels; ++j) 
+	  if (recompute[i] || recompute[j]) js[num_of_pairs++] = j;
+	d2_compute_distance_bounds_batch(centroids, i, centroids, js, num_of_pairs, selected_phase, 
+					 &thread_work, p_data->size + i, dist, dist_lower);
+	for (j=0; j<num_of_pairs; ++j) {
+	  /* only lower bounds of centroid distances are safe for pruning */
+	  double d = dist_lower[j];
+	  dist_count +=1;
+	  p_tr->c[i*num_of_labels + js[j]] = d; 
+	  p_tr->c[i + js[j]*num_of_labels] = d;
+	}
+      }
+    free(g_var);
+  }
+#ifdef __USE_MPI__
+  /* pairs kept are the same over processors, and the others are zero but on one */
+  MPI_Allreduce(MPI_IN_PLACE, p_tr->c, num_of_labels*num_of_labels, MPI_SCALAR, MPI_MAX, MPI_COMM_WORLD);
+#endif
+  for (i=0; i<num_of_labels; ++i) if (recompute[i]) p_tr->drift[i] = 0;
+  free(recompute);
+  for (i=0; i<num_of_labels; ++i) {
+    size_t j;
+    p_tr->s[i] = DBL_MAX;
+    for (j=0; j<num_of_labels; ++j)
+      if (j != i && p_tr->s[i] > p_tr->c[i*num_of_labels + j] / 2.f) 
+	p_tr->s[i] = p_tr->c[i*num_of_labels + j] / 2.f;
+  }
+
+  /* initialization */
+  for (i=0; i<size; ++i) 
+    if (d2_alg_type == D2_CENTROID_BADMM)
+      { var_work->label_switch[i] = 0; }
+
+  update_centroid_means(p_data, centroids, selected_phase, var_work);
+  if ((size_t) p_tr->num_of_bounds == num_of_labels)
+    count = labeling_prep_elkan(p_data, centroids, var_work, selected_phase, &dist_count);
+  else if (p_tr->num_of_bounds == 1)
+    count = labeling_prep_single_bound(p_data, centroids, var_work, selected_phase, &dist_count);
+  else {
+    if (p_tr->group[0] < 0) group_centroids(p_tr->c, num_of_labels, p_tr->num_of_bounds, p_tr->group);
+    count = labeling_prep_yinyang(p_data, centroids, var_work, selected_phase, &dist_count);
+  }
 
 #ifdef __USE_MPI__
   assert(sizeof(size_t)  == sizeof(unsigned long long));
@@ -236,8 +990,9 @@ size_t d2_labeling_prep(__IN_OUT__ mph *p_data,
 
   VPRINTF("\n\t\t\t\t %ld objects change their labels\n\t\t\t\t %ld distance pairs computed\n\t\t\t\t seconds: %f\n", count, dist_count, getRealTime() - global_startTime);
 
-  // set time budget for update step
+  // set time budget and tolerances for update step
   time_budget = time_budget_ratio * (getRealTime() - startTime);
+  tol_scale = tolerance_scale(count, p_data->global_size);
   return count;
 }
 
@@ -272,6 +1027,9 @@ int d2_copy(mph* a, mph *b) {
 	memcpy(b->ph[n].p_supp, a->ph[n].p_supp, a->ph[n].col * a->ph[n].dim * sizeof(SCALAR));
 	break;
       case D2_HISTOGRAM:
+	b->ph[n].hist_power = a->ph[n].hist_power;
+	b->ph[n].hist_scale = a->ph[n].hist_scale;
+	/* fall through */
       case D2_SPARSE_HISTOGRAM:
 	b->ph[n].dist_mat = a->ph[n].dist_mat;
 	break;
@@ -302,15 +1060,53 @@ size_t d2_labeling_post(mph *p_data,
 
   for (i=0; i<num_of_labels; ++i) {
     double d;
+    /* upper bounds of the drifts keep the bounds of trieq valid */
     d = d2_compute_distance(c_new, i, c_old, i, selected_phase, var_work, p_data->size + i);
     d_changes[i] = d;
   }
 
-  for (j=0; j<size; ++j) {
-    SCALAR * L = var_work->tr.l + j*num_of_labels;
-    for (i=0; i<num_of_labels; ++i) L[i] = max(L[i] - d_changes[i], 0);
-    var_work->tr.u[j] += d_changes[label[j]];
-    var_work->tr.r[j] = 1;
+  /* distances between centroids stay bounded from below after the drifts */
+  for (i=0; i<num_of_labels; ++i) {
+    SCALAR *c = var_work->tr.c + i*num_of_labels;
+    for (j=0; j<(size_t) num_of_labels; ++j) 
+      if (j != (size_t) i) c[j] = max(c[j] - d_changes[i] - d_changes[j], 0);
+    if (var_work->tr.drift[i] >= 0) var_work->tr.drift[i] += d_changes[i];
+  }
+
+  if (var_work->tr.num_of_bounds == num_of_labels) {
+    for (j=0; j<size; ++j) {
+      SCALAR * L = var_work->tr.l + j*num_of_labels;
+      for (i=0; i<num_of_labels; ++i) L[i] = max(L[i] - d_changes[i], 0);
+      var_work->tr.u[j] += d_changes[label[j]];
+      var_work->tr.r[j] = 1;
+    }
+  } else if (var_work->tr.num_of_bounds == 1) {
+    /* a single lower bound drops by the largest drift among the other centroids */
+    int i1 = 0; SCALAR d1 = 0, d2 = 0;
+    for (i=0; i<num_of_labels; ++i) 
+      if (d_changes[i] > d1) {d2 = d1; d1 = d_changes[i]; i1 = i;}
+      else if (d_changes[i] > d2) d2 = d_changes[i];
+    for (j=0; j<size; ++j) {
+      SCALAR *L = var_work->tr.l + j;
+      *L = max(*L - (label[j] == i1 ? d2 : d1), 0);
+      var_work->tr.u[j] += d_changes[label[j]];
+      var_work->tr.r[j] = 1;
+    }
+  } else {
+    /* a bound of a group drops by the largest drift in the group */
+    int num_of_groups = var_work->tr.num_of_bounds;
+    SCALAR *g_changes = _D2_CALLOC_SCALAR(num_of_groups);
+    for (i=0; i<num_of_labels; ++i) {
+      int g = var_work->tr.group[i];
+      if (d_changes[i] > g_changes[g]) g_changes[g] = d_changes[i];
+    }
+    for (j=0; j<size; ++j) {
+      SCALAR * L = var_work->tr.l + j*num_of_groups;
+      for (i=0; i<num_of_groups; ++i) L[i] = max(L[i] - g_changes[i], 0);
+      var_work->tr.u[j] += d_changes[label[j]];
+      var_work->tr.r[j] = 1;
+    }
+    _D2_FREE(g_changes);
   }
 
   _D2_FREE(d_changes);
@@ -319,45 +1115,54 @@ size_t d2_labeling_post(mph *p_data,
 
 
 /** Compute the distance from each point to the all centroids.
-    This part can be parallelized.
+    Objects are distributed over threads dynamically, since their costs
+    vary with the numbers of supports, and each thread works on its own
+    view of var_work (see d2_thread_work()).
  */
 size_t d2_labeling(__IN_OUT__ mph *p_data,
 		mph *centroids,
 		var_mph * var_work,
 		int selected_phase) {
-  size_t i, count = 0;
-  int *label = p_data->label;
+  size_t count = 0;
   size_t size = p_data->size;
   double cost = 0.f;
   double startTime;
+  char relaxed = use_relaxed(p_data, selected_phase);
 
   startTime = getRealTime();
+  update_centroid_means(p_data, centroids, selected_phase, var_work);
 
-  for (i=0; i<size; ++i) {
-    double min_distance = -1;	
-    int jj = label[i]>=0? label[i]: 0;
-    size_t j;
-
-    for (j=0; j<centroids->size; ++j) {
-      double d;
-      d = d2_compute_distance(p_data, i, centroids, j, selected_phase, var_work, i);
-      if (min_distance < 0 || d < min_distance) {
-	min_distance = d; jj = j;
-      }
-    }
-    cost += min_distance * min_distance;
-
-    if (p_data->label[i] == jj) {
-      if (d2_alg_type == D2_CENTROID_BADMM) {
-	var_work->label_switch[i] = 0;
-      }
-    } else {
-      p_data->label[i] = jj;
-      if (d2_alg_type == D2_CENTROID_BADMM) {
-	var_work->label_switch[i] = 1;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads) reduction(+:count,cost)
+#endif
+  {
+    var_mph thread_work;
+    var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+    long i;
+    d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (i=0; i<(long) size; ++i) {
+      double min_distance;
+      size_t jj = nearest_centroid(p_data, i, centroids, selected_phase, &thread_work, relaxed,
+				   &min_distance, NULL, NULL);
+      cost += min_distance * min_distance;
+
+      if (p_data->label[i] == (int) jj) {
+	if (d2_alg_type == D2_CENTROID_BADMM) {
+	  var_work->label_switch[i] = 0;
+	}
+      } else {
+	p_data->label[i] = jj;
+	if (d2_alg_type == D2_CENTROID_BADMM) {
+	  var_work->label_switch[i] = 1;
+	}
+	count ++;
       }
-      count ++;
     }
+    free(g_var);
   }
 
 #ifdef __USE_MPI__
@@ -369,13 +1174,277 @@ size_t d2_labeling(__IN_OUT__ mph *p_data,
   VPRINTF("\t %ld labels change.\tmean cost %lf\ttime %f s [done]\n", 
            count, cost/p_data->global_size, getRealTime() - global_startTime);
 
-  // set time budget for update step
+  // set time budget and tolerances for update step
   time_budget = time_budget_ratio * (getRealTime() - startTime) / p_data->num_of_labels;
+  tol_scale = tolerance_scale(count, p_data->global_size);
   
   return count;
 }
 
 
+/* a uniform random number in [0, 1) that is the same over processors */
+static double uniform_real() {
+  double u = (double) rand() / ((double) RAND_MAX + 1);
+#ifdef __USE_MPI__
+  MPI_Bcast(&u, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+  return u;
+}
+
+/* index of @param(w) where the cumulative sum passes @param(u), or the last nonzero one */
+static size_t locate_weighted(const double *w, size_t n, double u) {
+  size_t i, last = n;
+  for (i=0; i<n; ++i) 
+    if (w[i] > 0) {
+      last = i;
+      if (u < w[i]) return i;
+      u -= w[i];
+    }
+  return last;
+}
+
+/* index of @param(w) picked with probability proportional to it, or n if all are zero */
+static size_t pick_weighted(const double *w, size_t n) {
+  double total = 0.;
+  size_t i;
+  for (i=0; i<n; ++i) total += w[i];
+  if (total <= 0) return n;
+  return locate_weighted(w, n, uniform_real() * total);
+}
+
+/**
+ * Global index of an object picked with probability proportional to
+ * @param(cost) over processors, where the processor whose range of the
+ * cumulative cost holds the shared random number picks its local object
+ * by the same number. Return (size_t) -1 if no object is picked, e.g. all
+ * costs are zero or the ranges miss the number by round-off.
+ */
+static size_t sample_object(const double *cost, size_t size, size_t offset) {
+  double local = 0., before = 0., total, u;
+  unsigned long long g = 0;
+  size_t i;
+  for (i=0; i<size; ++i) local += cost[i];
+  total = local;
+#ifdef __USE_MPI__
+  MPI_Exscan(&local, &before, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  if (world_rank == 0) before = 0.;
+  MPI_Allreduce(&local, &total, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  u = uniform_real() * total;
+  if (local > 0 && u >= before && (u < before + local || world_rank == nprocs - 1)) 
+    g = offset + locate_weighted(cost, size, u - before) + 1;
+#ifdef __USE_MPI__
+  MPI_Allreduce(MPI_IN_PLACE, &g, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+#endif
+  return (size_t) g - 1;
+}
+
+/* objects of fewer supports than centroids are not picked, as in d2_centroid_rands() */
+static char is_seedable(mph *p_data, size_t i, int selected_phase) {
+  int n;
+  for (n=0; n<p_data->s_ph; ++n)
+    if ((selected_phase < 0 || n == selected_phase) && 
+	p_data->ph[n].metric_type != D2_SPARSE_HISTOGRAM &&
+	p_data->ph[n].p_str[i] < p_data->ph[n].str) return false;
+  return true;
+}
+
+/* allocate @param(c) to hold at most @param(capacity) centroids */
+static void allocate_centroids(mph *p_data, int selected_phase, size_t capacity, __OUT__ mph *c) {
+  int n;
+  c->s_ph = p_data->s_ph;
+  c->size = 0;
+  c->label = NULL;
+  c->ph = (sph *) malloc(p_data->s_ph * sizeof(sph));
+  for (n=0; n<p_data->s_ph; ++n) 
+    if (selected_phase < 0 || n == selected_phase) {
+      d2_allocate_sph(&c->ph[n], p_data->ph[n].dim, p_data->ph[n].str, capacity, 0., p_data->ph[n].metric_type % D2_GROUP_SIZE);
+    } else {
+      c->ph[n].dim = p_data->ph[n].dim;
+      c->ph[n].col = 0;
+      c->ph[n].metric_type = p_data->ph[n].metric_type % D2_GROUP_SIZE;
+    }
+}
+
+/* set @param(c) to the objects of global indices @param(samples) on all processors */
+static void sample_centroids(mph *p_data, int selected_phase, size_t offset,
+			     const size_t *samples, size_t count, __OUT__ mph *c) {
+  size_t j, *local = _D2_MALLOC_SIZE_T(count);
+  int n;
+  for (j=0; j<count; ++j) 
+    local[j] = (samples[j] >= offset && samples[j] < offset + p_data->size) ? samples[j] - offset : p_data->size;
+  c->size = count;
+  for (n=0; n<p_data->s_ph; ++n) 
+    if (selected_phase < 0 || n == selected_phase) {
+      d2_centroid_sample(p_data, n, local, count, c->ph + n);
+      broadcast_centroids(c, n);
+    }
+  _D2_FREE(local);
+}
+
+/* set @param(centroids) to random objects, see d2_centroid_rands() */
+static void random_centroids(mph *p_data, mph *centroids, int selected_phase) {
+  int n;
+  for (n=0; n<p_data->s_ph; ++n) 
+    if (selected_phase < 0 || n == selected_phase) {
+      d2_centroid_rands(p_data, n, centroids->ph + n);
+      broadcast_centroids(centroids, n);
+    }
+}
+
+/**
+ * Seed centroids by k-means|| (Bahmani et al., Scalable K-Means++, VLDB
+ * 2012). Starting from a random object, candidates are sampled in
+ * d2_init_rounds rounds, where each object is picked with probability
+ * proportional to its squared distance to the nearest candidate, 2k of
+ * them in total on average. The candidates are then weighted by the numbers
+ * of objects nearest to them, and k centroids are chosen among them by
+ * k-means++ on the weighted candidates. It falls back to random objects
+ * if there are less than k distinct candidates.
+ */
+static void seed_centroids(mph *p_data, mph *centroids, int selected_phase, var_mph *var_work) {
+  const size_t size = p_data->size, num_of_labels = centroids->size;
+  const double oversampling = 2. * num_of_labels / d2_init_rounds;
+  const size_t max_cand = 1 + 4*num_of_labels;
+  size_t i, j, offset = 0, num_of_cand = 0, num_of_new = 1, num_of_picks = 0;
+  size_t *cand = _D2_MALLOC_SIZE_T(1), *picks = _D2_MALLOC_SIZE_T(num_of_labels);
+  size_t *nearest = _D2_MALLOC_SIZE_T(size);
+  double *cost = (double *) malloc(size * sizeof(double)), *weight, *cand_cost, *cand_d2;
+  int r;
+  mph c;
+
+  VPRINTF("Seeding centroids by k-means|| ... "); VFLUSH();
+  /* reproducible as shuffle() of d2_centroid_rands(), while processors oversample differently */
+  srand(world_rank);
+#ifdef __USE_MPI__
+  {
+    unsigned long long local_size = size, before = 0;
+    MPI_Exscan(&local_size, &before, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (world_rank == 0) before = 0;
+    offset = before;
+  }
+#endif
+
+  /* the first candidate */
+  for (i=0; i<size; ++i) cost[i] = is_seedable(p_data, i, selected_phase);
+  cand[0] = sample_object(cost, size, offset);
+  if (cand[0] == (size_t) -1) {
+    VPRINTF("no object to start from, use random objects instead\n");
+    random_centroids(p_data, centroids, selected_phase);
+    _D2_FREE(cand); _D2_FREE(picks); _D2_FREE(nearest);
+    free(cost);
+    return;
+  }
+  for (i=0; i<size; ++i) cost[i] = DBL_MAX;
+
+  allocate_centroids(p_data, selected_phase, max_cand, &c);
+  for (r=0; num_of_new > 0; ++r) {
+    double phi = 0.;
+    size_t *local_new;
+
+    /* squared distances to the new candidates */
+    sample_centroids(p_data, selected_phase, offset, cand + num_of_cand, num_of_new, &c);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(var_work->num_of_threads)
+#endif
+    {
+      var_mph thread_work;
+      var_sph *g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
+      long i;
+      d2_thread_work(var_work, selected_phase, g_var, &thread_work);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (i=0; i<(long) size; ++i) {
+	size_t t;
+	for (t=0; t<num_of_new; ++t) {
+	  double d = d2_compute_distance(p_data, i, &c, t, selected_phase, &thread_work, i);
+	  if (d*d < cost[i]) {cost[i] = d*d; nearest[i] = num_of_cand + t;}
+	}
+      }
+      free(g_var);
+    }
+    num_of_cand += num_of_new;
+    if (r == d2_init_rounds) break;
+
+    /* each object is picked with probability oversampling * cost / phi */
+    for (i=0; i<size; ++i) if (is_seedable(p_data, i, selected_phase)) phi += cost[i];
+#ifdef __USE_MPI__
+    MPI_Allreduce(MPI_IN_PLACE, &phi, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    local_new = _D2_MALLOC_SIZE_T(size);
+    num_of_new = 0;
+    if (phi > 0) 
+      for (i=0; i<size; ++i) 
+	if (is_seedable(p_data, i, selected_phase) && cost[i] > 0 && 
+	    (double) rand() / ((double) RAND_MAX + 1) < oversampling * cost[i] / phi) 
+	  local_new[num_of_new++] = offset + i;
+#ifdef __USE_MPI__
+    {
+      int *counts = (int *) malloc(2 * nprocs * sizeof(int)), *displs = counts + nprocs, count = num_of_new, n;
+      MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+      for (num_of_new = 0, n=0; n<nprocs; ++n) {displs[n] = num_of_new; num_of_new += counts[n];}
+      cand = (size_t *) realloc(cand, (num_of_cand + num_of_new) * sizeof(size_t));
+      assert(sizeof(size_t) == sizeof(unsigned long long));
+      MPI_Allgatherv(local_new, count, MPI_UNSIGNED_LONG_LONG, cand + num_of_cand, counts, displs, 
+		     MPI_UNSIGNED_LONG_LONG, MPI_COMM_WORLD);
+      free(counts);
+    }
+#else
+    cand = (size_t *) realloc(cand, (num_of_cand + num_of_new) * sizeof(size_t));
+    memcpy(cand + num_of_cand, local_new, num_of_new * sizeof(size_t));
+#endif
+    _D2_FREE(local_new);
+    /* which hardly happens, since 2k candidates are expected */
+    if (num_of_cand + num_of_new > max_cand) num_of_new = max_cand - num_of_cand;
+  }
+
+  /* weights of candidates */
+  weight = (double *) calloc(num_of_cand, sizeof(double));
+  cand_cost = (double *) malloc(2 * num_of_cand * sizeof(double));
+  cand_d2 = cand_cost + num_of_cand;
+  for (i=0; i<size; ++i) weight[nearest[i]] += 1;
+#ifdef __USE_MPI__
+  MPI_Allreduce(MPI_IN_PLACE, weight, num_of_cand, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+
+  /* k-means++ on the weighted candidates, whose distances are taken from their objects */
+  for (j=0; j<num_of_cand; ++j) cand_cost[j] = weight[j];
+  while (num_of_picks < num_of_labels) {
+    size_t pick = pick_weighted(cand_cost, num_of_cand);
+    if (pick == num_of_cand) break;
+    picks[num_of_picks++] = cand[pick];
+    if (num_of_picks == num_of_labels) break;
+
+    sample_centroids(p_data, selected_phase, offset, cand + pick, 1, &c);
+    cand_cost[pick] = 0.;
+    for (j=0; j<num_of_cand; ++j) {
+      cand_d2[j] = 0.;
+      if (cand_cost[j] > 0 && cand[j] >= offset && cand[j] < offset + size) {
+	double d = d2_compute_distance(p_data, cand[j] - offset, &c, 0, selected_phase, var_work, cand[j] - offset);
+	cand_d2[j] = d*d;
+      }
+    }
+#ifdef __USE_MPI__
+    MPI_Allreduce(MPI_IN_PLACE, cand_d2, num_of_cand, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    for (j=0; j<num_of_cand; ++j) 
+      if (num_of_picks == 1 || weight[j] * cand_d2[j] < cand_cost[j]) cand_cost[j] = weight[j] * cand_d2[j];
+  }
+
+  if (num_of_picks == num_of_labels) {
+    sample_centroids(p_data, selected_phase, offset, picks, num_of_labels, centroids);
+    VPRINTF("%zd candidates [done]\n", num_of_cand);
+  } else {
+    VPRINTF("only %zd distinct candidates, use random objects instead\n", num_of_picks);
+    random_centroids(p_data, centroids, selected_phase);
+  }
+
+  d2_free(&c);
+  _D2_FREE(cand); _D2_FREE(picks); _D2_FREE(nearest);
+  free(cost); free(weight); free(cand_cost);
+}
+
 int d2_init_centroid(mph *p_data, __OUT__ mph *centroids, int selected_phase, int allocate_only) {
   int i;
   // MPI note: to be done only on one node
@@ -403,6 +1472,31 @@ int d2_init_centroid(mph *p_data, __OUT__ mph *centroids, int selected_phase, in
   return 0;
 }
 
+/* update centroids from the labels of p_data by the selected centroid method */
+static void update_centroids(mph *p_data, mph *centroids, int selected_phase, var_mph *var_work) {
+  int i;
+  for (i=0; i<p_data->s_ph; ++i) 
+    if (selected_phase < 0 || i == selected_phase) {
+      VPRINTF("\t phase %d: \n", i);            
+      
+      if (p_data->ph[i].hist_power > 0) {
+#ifndef __USE_MPI__
+	d2_centroid_sphQuantile(p_data, i, centroids->ph + i, centroids->ph + i);
+	continue;
+#else
+	VPRINTF("\t closed-form centroids of |i-j|^%d are not available with MPI, use the centroid method instead\n",
+		p_data->ph[i].hist_power);
+#endif
+      }
+      if (d2_alg_type == D2_CENTROID_BADMM) 
+	d2_centroid_sphBregman(p_data, var_work, i, centroids->ph + i, centroids->ph + i);
+      if (d2_alg_type == D2_CENTROID_GRADDEC)
+	d2_centroid_sphGradDecent(p_data, var_work, i, centroids->ph + i, centroids->ph + i);
+      if (d2_alg_type == D2_CENTROID_ADMM)
+	d2_centroid_sphADMM(p_data, var_work, i, centroids->ph + i, centroids->ph + i);
+    }
+}
+
 /**
  * The main algorithm for d2 clustering 
  */
@@ -426,6 +1520,7 @@ int d2_clustering(int num_of_clusters,
   size_t label_change_count, *label_count;
   var_mph var_work = {.tr = {NULL, NULL, NULL, NULL, NULL}};
   mph the_centroids_copy = {0, 0, 0, NULL, 0, NULL};
+  char is_seeded = false;
 
   VPRINTF(intro);
 
@@ -435,7 +1530,8 @@ int d2_clustering(int num_of_clusters,
   p_data->num_of_labels = num_of_clusters;
 
   if (!centroids->ph) {
-    d2_init_centroid(p_data, centroids, selected_phase, false);
+    d2_init_centroid(p_data, centroids, selected_phase, d2_init_rounds > 0);
+    is_seeded = d2_init_rounds > 0;
   } else {
     VPRINTF("Centroid initialization provided\n");
   }
@@ -447,6 +1543,7 @@ int d2_clustering(int num_of_clusters,
 
   // start centroid-based clustering here
   d2_solver_setup();
+  if (is_seeded) seed_centroids(p_data, centroids, selected_phase, &var_work);
 
 #ifdef __USE_MPI__
   MPI_Pcontrol(1);
@@ -484,18 +1581,7 @@ int d2_clustering(int num_of_clusters,
     if (use_triangle) d2_copy(centroids, &the_centroids_copy);
 
     VPRINTF("\tUpdate centroids ... \n");
-    /* update centroids */
-    for (i=0; i<s_ph; ++i) 
-      if (selected_phase < 0 || i == selected_phase) {
-	VPRINTF("\t phase %d: \n", i);            
-      
-	if (d2_alg_type == D2_CENTROID_BADMM) 
-	  d2_centroid_sphBregman(p_data, &var_work, i, centroids->ph + i, centroids->ph + i);
-	if (d2_alg_type == D2_CENTROID_GRADDEC)
-	  d2_centroid_sphGradDecent(p_data, &var_work, i, centroids->ph + i, centroids->ph + i);
-	if (d2_alg_type == D2_CENTROID_ADMM)
-	  d2_centroid_sphADMM(p_data, &var_work, i, centroids->ph + i, centroids->ph + i);
-      }
+    update_centroids(p_data, centroids, selected_phase, &var_work);
 
     /* post updates */
     if (use_triangle) 
@@ -507,9 +1593,9 @@ int d2_clustering(int num_of_clusters,
   VPRINTF("Iteration time: %lf\n", getRealTime() - global_startTime);
 
   if (use_triangle)  label_change_count = d2_labeling(p_data, centroids, &var_work, selected_phase);
+  d2_free_work(&var_work, selected_phase);
   d2_solver_release();
 
-  d2_free_work(&var_work, selected_phase);
   if (use_triangle) d2_free(&the_centroids_copy);
 
 
@@ -525,6 +1611,166 @@ int d2_clustering(int num_of_clusters,
 }
 
 
+/* copy the centroids @param(idx) of @param(a) to @param(c) allocated by allocate_centroids() */
+static void select_centroids(mph *a, int selected_phase, const size_t *idx, size_t count, __OUT__ mph *c) {
+  size_t t;
+  int n;
+  c->size = count;
+  for (n=0; n<a->s_ph; ++n) 
+    if (selected_phase < 0 || n == selected_phase) {
+      sph *a_ph = a->ph + n, *c_ph = c->ph + n;
+      int str = a_ph->str, dim = a_ph->dim;
+      assert(c_ph->str == str);
+      c_ph->dist_mat = a_ph->dist_mat;
+      c_ph->vocab_size = a_ph->vocab_size;
+      c_ph->hist_power = a_ph->hist_power;
+      c_ph->hist_scale = a_ph->hist_scale;
+      for (t=0; t<count; ++t) {
+	c_ph->p_str[t] = str;
+	c_ph->p_str_cum[t] = t*str;
+	memcpy(c_ph->p_w + t*str, a_ph->p_w + idx[t]*str, str * sizeof(SCALAR));
+	if (a_ph->metric_type == D2_EUCLIDEAN_L2) 
+	  memcpy(c_ph->p_supp + t*str*dim, a_ph->p_supp + idx[t]*str*dim, str*dim * sizeof(SCALAR));
+	else if (a_ph->metric_type == D2_N_GRAM) 
+	  memcpy(c_ph->p_supp_sym + t*str*dim, a_ph->p_supp_sym + idx[t]*str*dim, str*dim * sizeof(int));
+      }
+      c_ph->col = count * str;
+    }
+}
+
+/**
+ * Move the centroids @param(idx) of @param(a) towards the centroids of
+ * @param(c) by the rates @param(eta), where supports of the same index
+ * are interpolated; symbolic supports are replaced.
+ */
+static void blend_centroids(mph *a, int selected_phase, const size_t *idx, const double *eta, mph *c) {
+  size_t t;
+  int n, j;
+  for (n=0; n<a->s_ph; ++n) 
+    if (selected_phase < 0 || n == selected_phase) {
+      sph *a_ph = a->ph + n, *c_ph = c->ph + n;
+      int str = a_ph->str, strxdim = a_ph->str * a_ph->dim;
+      for (t=0; t<c->size; ++t) {
+	SCALAR *a_w = a_ph->p_w + idx[t]*str, *c_w = c_ph->p_w + t*str;
+	for (j=0; j<str; ++j) a_w[j] += eta[t] * (c_w[j] - a_w[j]);
+	if (a_ph->metric_type == D2_EUCLIDEAN_L2) {
+	  SCALAR *a_supp = a_ph->p_supp + idx[t]*strxdim, *c_supp = c_ph->p_supp + t*strxdim;
+	  for (j=0; j<strxdim; ++j) a_supp[j] += eta[t] * (c_supp[j] - a_supp[j]);
+	} else if (a_ph->metric_type == D2_N_GRAM) {
+	  memcpy(a_ph->p_supp_sym + idx[t]*strxdim, c_ph->p_supp_sym + t*strxdim, strxdim * sizeof(int));
+	}
+      }
+    }
+}
+
+/**
+ * Mini-batch d2 clustering (Sculley, Web-Scale K-Means Clustering, WWW
+ * 2010) of d2 streamed from @param(filename), where only a batch of
+ * @param(p_batch->size) d2 per processor is resident, see d2_read_next().
+ * Each of @param(max_iter) batches is labeled by the current centroids,
+ * and the centroids of its non-empty clusters are computed by the
+ * selected centroid method warm started from the current centroids. A
+ * centroid then moves towards its batch centroid by the rate n/N, where n
+ * is the size of the cluster in the batch and N the accumulated size over
+ * batches, so that the centroid is the running mean of its batch centroids.
+ * Batches are read in the order of the file, which should be shuffled,
+ * e.g. by --prepare_batches of the app.
+ */
+int d2_clustering_minibatch(int num_of_clusters, 
+			    int max_iter, 
+			    const char* filename,
+			    const char* meta_filename,
+			    mph *p_batch, 
+			    __OUT__ mph *centroids, /* initialized from the first batch if centroids->ph is NULL */
+			    int selected_phase,
+			    const char* log_file) {
+  size_t i, l, num_of_active;
+  size_t *label_count = _D2_CALLOC_SIZE_T(num_of_clusters), *total_count = _D2_CALLOC_SIZE_T(num_of_clusters);
+  size_t *active = _D2_MALLOC_SIZE_T(num_of_clusters), *position = _D2_MALLOC_SIZE_T(num_of_clusters);
+  double *eta = (double *) malloc(num_of_clusters * sizeof(double));
+  int iter;
+  mph active_centroids;
+  FILE *fp;
+
+  VPRINTF(intro);
+
+  assert(num_of_clusters>0 && max_iter > 0 && selected_phase < p_batch->s_ph);
+  
+  fp = d2_open(filename, meta_filename, p_batch);
+  d2_solver_setup();
+  allocate_centroids(p_batch, selected_phase, num_of_clusters, &active_centroids);
+
+#ifdef __USE_MPI__
+  MPI_Pcontrol(1);
+#endif
+  global_startTime = getRealTime();
+  for (iter=0; iter<max_iter; ++iter) {
+    var_mph var_work = {.tr = {NULL, NULL, NULL, NULL, NULL}};
+    VPRINTF("Batch %d ... \n", iter);
+    d2_read_next(fp, p_batch);
+    p_batch->num_of_labels = num_of_clusters;
+    for (i=0; i<p_batch->size; ++i) p_batch->label[i] = -1;
+    d2_allocate_work(p_batch, &var_work, false, selected_phase);
+
+    if (!centroids->ph) {
+      d2_init_centroid(p_batch, centroids, selected_phase, d2_init_rounds > 0);
+      if (d2_init_rounds > 0) seed_centroids(p_batch, centroids, selected_phase, &var_work);
+    }
+    assert(centroids->s_ph == p_batch->s_ph && centroids->size == (size_t) num_of_clusters);
+
+    VPRINTF("\tLabeling batch ... "); VFLUSH();
+    d2_labeling(p_batch, centroids, &var_work, selected_phase);
+
+    /* clusters of the batch */
+    for (l=0; l<(size_t) num_of_clusters; ++l) label_count[l] = 0;
+    for (i=0; i<p_batch->size; ++i) ++label_count[p_batch->label[i]];
+#ifdef __USE_MPI__
+    assert(sizeof(size_t) == sizeof(unsigned long long));
+    MPI_Allreduce(MPI_IN_PLACE, label_count, num_of_clusters, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    for (num_of_active = 0, l=0; l<(size_t) num_of_clusters; ++l) 
+      if (label_count[l] > 0) {
+	total_count[l] += label_count[l];
+	eta[num_of_active] = (double) label_count[l] / total_count[l];
+	position[l] = num_of_active;
+	active[num_of_active++] = l;
+      }
+    for (i=0; i<p_batch->size; ++i) p_batch->label[i] = position[p_batch->label[i]];
+    p_batch->num_of_labels = num_of_active;
+
+    /* centroids of the batch, warm started from the current ones */
+    VPRINTF("\tUpdate centroids of %zd clusters ... \n", num_of_active);
+    select_centroids(centroids, selected_phase, active, num_of_active, &active_centroids);
+    update_centroids(p_batch, &active_centroids, selected_phase, &var_work);
+    blend_centroids(centroids, selected_phase, active, eta, &active_centroids);
+
+    p_batch->num_of_labels = num_of_clusters;
+    d2_free_work(&var_work, selected_phase);
+
+    if (log_file && ((iter+1) % 10 == 0) ){
+      char centroid_filename[255];
+      sprintf(centroid_filename, "%s_c.d2", log_file);
+      d2_write(centroid_filename, centroids);
+    }
+  }
+#ifdef __USE_MPI__
+  MPI_Pcontrol(0);
+#endif
+  VPRINTF("Iteration time: %lf\n", getRealTime() - global_startTime);
+
+  d2_solver_release();
+  fclose(fp);
+
+  for (l=0; l<(size_t) num_of_clusters; ++l) VPRINTF("%zd ", total_count[l]);
+  VPRINTF("\n");
+  d2_free(&active_centroids);
+  _D2_FREE(label_count); _D2_FREE(total_count);
+  _D2_FREE(active); _D2_FREE(position);
+  free(eta);
+  return 0;
+}
+
+
 int d2_assignment(int num_of_clusters,
 		  mph *p_data, 
 		  mph *centroids, 
@@ -540,8 +1786,8 @@ int d2_assignment(int num_of_clusters,
   d2_solver_setup();
   global_startTime = getRealTime();
   d2_labeling(p_data, centroids, &var_work, selected_phase);
-  d2_solver_release();
   d2_free_work(&var_work, selected_phase);
+  d2_solver_release();
   return 0;
 }
 
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 #include "d2/clustering.h"
 #include "d2/math.h"
 #include "d2/centroid_util.h"
@@ -10,12 +11,38 @@
 #include <mpi.h>
 #endif
 
-/** Load Data Set: see specification of format at README.md */
-int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
+/**
+ * Detect whether dist_mat of a histogram phase is c*|i-j| or c*(i-j)^2,
+ * up to a relative round-off of the text format, and set hist_power.
+ */
+static void detect_hist_power(sph *p_sph) {
+  const int str = p_sph->vocab_size;
+  const SCALAR *dist_mat = p_sph->dist_mat;
+  int p, i, j;
+
+  p_sph->hist_power = 0;
+  if (str < 2 || dist_mat[1] <= 0) return;
+  for (p=1; p<=2; ++p) {
+    double scale = dist_mat[1];
+    for (j=0; j<str; ++j) {
+      for (i=0; i<str; ++i) {
+	double expected = scale * (p == 1 ? abs(i-j) : (i-j)*(i-j));
+	if (fabs(dist_mat[i + j*str] - expected) > 1E-6 * (expected > scale ? expected : scale)) break;
+      }
+      if (i < str) break;
+    }
+    if (j == str) {
+      p_sph->hist_power = p;
+      p_sph->hist_scale = scale;
+      return;
+    }
+  }
+}
+
+/* open the data file of the processor */
+static FILE* open_data(const char* filename) {
   char filename_main[255];
   FILE *fp =NULL;
-  double io_startTime;
-  io_startTime = getRealTime();
 
   if (nprocs > 1) {
     sprintf(filename_main, "%s.%d", filename, world_rank);
@@ -28,29 +55,14 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
   }
 
   assert(fp);
+  return fp;
+}
 
-  size_t i;
+/* load header information of phases if available */
+static void read_meta(const char* filename, const char* meta_filename, mph *p_data) {
   int n;
-  int **p_str, **p_supp_sym;
-  SCALAR **p_supp, **p_w;
   int s_ph = p_data->s_ph;
-  size_t size = p_data->size;
 
-  p_str  = (int **) malloc(s_ph * sizeof(int *));
-  p_supp_sym=(int**) malloc(s_ph * sizeof(int *));
-  p_supp = (SCALAR **) malloc(s_ph * sizeof(SCALAR *));
-  p_w    = (SCALAR **) malloc(s_ph * sizeof(SCALAR *));
-  
-  for (n=0; n<s_ph; ++n) {
-    p_str[n]  = p_data->ph[n].p_str;
-    p_supp_sym[n]  = p_data->ph[n].p_supp_sym;
-    p_supp[n] = p_data->ph[n].p_supp;
-    p_w[n]    = p_data->ph[n].p_w;
-    p_data->ph[n].col = 0;
-  }
-
-
-  // Load header information if available
   for (n=0; n<s_ph; ++n) {
     if (p_data->ph[n].metric_type == D2_HISTOGRAM ||
 	p_data->ph[n].metric_type == D2_SPARSE_HISTOGRAM) {
@@ -69,6 +81,7 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
 	fscanf(fp_new, SCALAR_STDIO_TYPE, &(p_data->ph[n].dist_mat[i]));
       p_data->ph[n].vocab_size = str;
       fclose(fp_new);
+      if (p_data->ph[n].metric_type == D2_HISTOGRAM) detect_hist_power(p_data->ph + n);
     }
     else if (p_data->ph[n].metric_type == D2_WORD_EMBED) {
       char filename_extra[255];
@@ -88,20 +101,42 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
       fclose(fp_new);
     }
   }
+}
 
-  // Read main data file
-  for (i=0; i<size; ++i) {
+/**
+ * Read d2 from @param(fp) into the entries [start, p_data->size) of
+ * p_data, following the columns already read, and return the number of
+ * d2 read before the end of file.
+ */
+static size_t read_objects(FILE *fp, mph *p_data, size_t start) {
+  size_t i;
+  int n;
+  int **p_str, **p_supp_sym;
+  SCALAR **p_supp, **p_w;
+  int s_ph = p_data->s_ph;
+  size_t size = p_data->size;
+
+  p_str  = (int **) malloc(s_ph * sizeof(int *));
+  p_supp_sym=(int**) malloc(s_ph * sizeof(int *));
+  p_supp = (SCALAR **) malloc(s_ph * sizeof(SCALAR *));
+  p_w    = (SCALAR **) malloc(s_ph * sizeof(SCALAR *));
+  
+  for (n=0; n<s_ph; ++n) {
+    size_t col = p_data->ph[n].col;
+    p_str[n]  = p_data->ph[n].p_str + start;
+    p_supp_sym[n]  = p_data->ph[n].p_supp_sym ? p_data->ph[n].p_supp_sym + col : NULL;
+    p_supp[n] = p_data->ph[n].p_supp ? p_data->ph[n].p_supp + col * p_data->ph[n].dim : NULL;
+    p_w[n]    = p_data->ph[n].p_w + col;
+  }
+
+  for (i=start; i<size; ++i) {
     for (n=0; n<s_ph; ++n) {      
       SCALAR *p_supp_sph, *p_w_sph, w_sum;
       int *p_supp_sym_sph;
       int dim, str, strxdim, c, j;
       // read dimension and stride    
       c=fscanf(fp, "%d", &dim); 
-      if (c!=1) {
-	fprintf(stderr, "rank %d warning: only read %zd d2!\n", world_rank, i);
-	p_data->size = i;
-	size = i; break;
-      }
+      if (c!=1) {size = i; break;}
       assert(dim == p_data->ph[n].dim);    
       fscanf(fp, "%d", &str); assert(str >= 0);
       if (str == 0) continue;
@@ -156,6 +191,8 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
 	p_supp_sph = p_supp[n];strxdim = str*dim;
 	for (j=0; j<strxdim; ++j)
 	  fscanf(fp, SCALAR_STDIO_TYPE, &p_supp_sph[j]); 
+	// supports on a line are kept in order, whose distances are merges of quantiles
+	if (dim == 1) d2_sort_supports_1d(str, p_supp_sph, p_w_sph, NULL);
 	p_supp[n] = p_supp[n] + strxdim;
       } else if (p_data->ph[n].metric_type == D2_WORD_EMBED ||
 		 p_data->ph[n].metric_type == D2_SPARSE_HISTOGRAM) {	
@@ -171,6 +208,19 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
     }
   }
 
+
+  // free the pointer space
+  free(p_w); free(p_supp); free(p_str); free(p_supp_sym);
+  return size - start;
+}
+
+/* set p_str_cum of phases after read */
+static void read_done(mph *p_data) {
+  size_t i;
+  int n;
+  int s_ph = p_data->s_ph;
+  size_t size = p_data->size;
+
   for (n=0; n<s_ph; ++n) 
   if (p_data->ph[n].col > 0) {
     size_t * p_str_cum = p_data->ph[n].p_str_cum;
@@ -185,9 +235,6 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
     }
   }
 
-  // free the pointer space
-  free(p_w); free(p_supp); free(p_str); free(p_supp_sym);
-  fclose(fp);
 
 #ifdef __USE_MPI__
   assert(sizeof(size_t)  == sizeof(unsigned long long));
@@ -195,12 +242,69 @@ int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
 #else
   p_data->global_size = p_data->size;
 #endif
+}
+
+/** Load Data Set: see specification of format at README.md */
+int d2_read(const char* filename, const char* meta_filename, mph *p_data) {
+  FILE *fp =NULL;
+  double io_startTime;
+  size_t count;
+  int n;
+  io_startTime = getRealTime();
+
+  fp = open_data(filename);
+  for (n=0; n<p_data->s_ph; ++n) p_data->ph[n].col = 0;
+  read_meta(filename, meta_filename, p_data);
+
+  // Read main data file
+  count = read_objects(fp, p_data, 0);
+  if (count < p_data->size) {
+    fprintf(stderr, "rank %d warning: only read %zd d2!\n", world_rank, count);
+    p_data->size = count;
+  }
+  read_done(p_data);
+  fclose(fp);
 
   VPRINTF("IO time: %lf\n", getRealTime() - io_startTime);
 
   return 0;
 }
 
+/**
+ * Streaming read: open the data file of the processor and load the meta
+ * data of phases, after which d2_read_next() reads d2 in batches.
+ */
+FILE* d2_open(const char* filename, const char* meta_filename, mph *p_data) {
+  FILE *fp = open_data(filename);
+  read_meta(filename, meta_filename, p_data);
+  return fp;
+}
+
+/**
+ * Read the next @param(p_data->size) d2 from @param(fp), which rewinds at
+ * the end of file, so that passes over the file go on as epochs.
+ */
+int d2_read_next(FILE *fp, mph *p_data) {
+  size_t i = 0, count;
+  char is_rewound = false;
+  int n;
+  for (n=0; n<p_data->s_ph; ++n) p_data->ph[n].col = 0;
+  while (i < p_data->size) {
+    count = read_objects(fp, p_data, i);
+    i += count;
+    if (i < p_data->size) {
+      if (count == 0 && is_rewound) {
+	fprintf(stderr, "rank %d error: no d2 to read!\n", world_rank);
+	exit(1);
+      }
+      rewind(fp);
+    }
+    is_rewound = (i < p_data->size);
+  }
+  read_done(p_data);
+  return 0;
+}
+
 int d2_write(const char* filename, mph *p_data) {
   FILE *fp = NULL;
   size_t i;
@@ -6,8 +6,14 @@
 #include "d2/clustering.h"
 #include "d2/math.h"
 #include "d2/param.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 extern int d2_alg_type;
+extern size_t d2_warmstart_size;
+extern size_t d2_bound_budget;
+extern int d2_bound_groups;
 
 
 /**
@@ -55,6 +61,7 @@ int d2_allocate_sph(sph *p_data_sph,
   }
 
   p_data_sph->is_meta_allocated = false;
+  p_data_sph->hist_power = 0;
   return 0;
 }
 
@@ -149,6 +156,15 @@ int d2_free(mph *p_data) {
 #if !defined(max)
 #define max(a,b) ((a) > (b)? (a) : (b))
 #endif
+/* bytes of cost matrices of a chunk of batched problems per thread and phase */
+#define D2_BATCH_BYTES (1 << 24)
+
+/* whether cost matrices of a phase are computed per problem, see prepare_distmat() */
+static char computes_distmat(sph *p_sph) {
+  return (p_sph->metric_type == D2_EUCLIDEAN_L2 && p_sph->dim > 1) ||
+    p_sph->metric_type == D2_WORD_EMBED || p_sph->metric_type == D2_N_GRAM;
+}
+
 int d2_allocate_work(mph *p_data, var_mph *var_work, char use_triangle, int selected_phase) {
   int i;
   size_t size = p_data->size;
@@ -156,6 +172,21 @@ int d2_allocate_work(mph *p_data, var_mph *var_work, char use_triangle, int sele
   trieq *p_tr = &var_work->tr;
   var_work->s_ph = p_data->s_ph;
 
+#ifdef _OPENMP
+  var_work->num_of_threads = omp_get_max_threads();
+#else
+  var_work->num_of_threads = 1;
+#endif
+
+  /* problems are batched by chunks, whose cost matrices fit in D2_BATCH_BYTES */
+  var_work->batch_size = max(num_of_labels, 1);
+  for (i=0; i<p_data->s_ph; ++i)
+    if ((i==selected_phase || selected_phase < 0) && computes_distmat(p_data->ph + i)) {
+      size_t stride = (size_t) p_data->ph[i].str * max(p_data->ph[i].str, p_data->ph[i].max_str);
+      size_t chunk = max(D2_BATCH_BYTES / (stride * sizeof(SCALAR)), 1);
+      if (chunk < var_work->batch_size) var_work->batch_size = chunk;
+    }
+
   var_work->g_var = (var_sph *) malloc(p_data->s_ph * sizeof(var_sph));
   if (d2_alg_type == D2_CENTROID_BADMM) {
       var_work->l_var_sphBregman = (var_sphBregman *) malloc(p_data->s_ph * sizeof(var_sphBregman));
@@ -179,12 +210,29 @@ int d2_allocate_work(mph *p_data, var_mph *var_work, char use_triangle, int sele
     var_work->g_var[i].C = _D2_MALLOC_SCALAR(str * (col + num_of_labels*str)); 
     assert(var_work->g_var[i].C);
 
+    // space for cost matrices of a chunk of batched problems per thread
+    var_work->g_var[i].batch_stride = (size_t) str * max(str, max_str);
+    var_work->g_var[i].C_batch = NULL;
+    if (computes_distmat(p_data->ph + i)) {
+      var_work->g_var[i].C_batch = _D2_MALLOC_SCALAR(var_work->num_of_threads * var_work->batch_size * var_work->g_var[i].batch_stride);
+      assert(var_work->g_var[i].C_batch);
+    }
+    var_work->g_var[i].batch = (d2_match_problem *) malloc(var_work->num_of_threads * var_work->batch_size * sizeof(d2_match_problem));
+
+    // space for weighted means of supports, which bound the distance from below
+    var_work->g_var[i].mean = NULL;
+    if (p_data->ph[i].metric_type == D2_EUCLIDEAN_L2 || p_data->ph[i].metric_type == D2_WORD_EMBED) {
+      var_work->g_var[i].mean = _D2_MALLOC_SCALAR(p_data->ph[i].dim * (size + num_of_labels));
+      assert(var_work->g_var[i].mean);
+      d2_compute_means(p_data->ph + i, size, var_work->g_var[i].mean);
+    }
+
     // precompute C if the metric type is D2_HISTOGRAM or D2_SPARSE_HISTOGRAM
     if (p_data->ph[i].metric_type == D2_HISTOGRAM) {
       SCALAR *C = var_work->g_var[i].C;
       size_t k;
       for (k=0; k< size; ++k) { 
-	_D2_CBLAS_FUNC(copy)(str*p_str[k], p_data->ph[k].dist_mat, 1, C + str*p_str_cum[k], 1);
+	_D2_CBLAS_FUNC(copy)(str*p_str[k], p_data->ph[i].dist_mat, 1, C + str*p_str_cum[k], 1);
       }
     } else if (p_data->ph[i].metric_type == D2_SPARSE_HISTOGRAM) {
       SCALAR *C = var_work->g_var[i].C;
@@ -215,15 +263,54 @@ int d2_allocate_work(mph *p_data, var_mph *var_work, char use_triangle, int sele
   }
   var_work->label_switch = (char *) malloc(size * sizeof(char)); 
 
+  var_work->num_of_labels = num_of_labels;
+  var_work->batch = (d2_match_problem *) malloc(var_work->num_of_threads * var_work->batch_size * sizeof(d2_match_problem));
+  var_work->batch_idx = _D2_MALLOC_SIZE_T(var_work->num_of_threads * num_of_labels);
+  var_work->batch_val = (double *) malloc(var_work->num_of_threads * 2 * var_work->batch_size * sizeof(double));
+  var_work->batch_dist = (double *) malloc(var_work->num_of_threads * 3 * num_of_labels * sizeof(double));
+
+  var_work->solver_ctx = (d2_solver_context **) malloc(var_work->num_of_threads * sizeof(d2_solver_context *));
+  for (i=0; i<var_work->num_of_threads; ++i) {
+    var_work->solver_ctx[i] = d2_solver_context_create();
+    d2_solver_context_warmstart(var_work->solver_ctx[i], d2_warmstart_size / var_work->num_of_threads);
+  }
+
   if (use_triangle) {
     size_t j;
-    p_tr->l = _D2_MALLOC_SCALAR(size * num_of_labels);
+    size_t max_bounds = size > 0 ? d2_bound_budget / (size * sizeof(SCALAR)) : (size_t) num_of_labels;
+    int num_of_bounds = d2_bound_groups;
+    /* Elkan's bounds if they fit the budget, otherwise Yinyang's of k/10 groups */
+    if (num_of_bounds <= 0) 
+      num_of_bounds = (max_bounds >= (size_t) num_of_labels) ? num_of_labels : num_of_labels / 10;
+    if (num_of_bounds > num_of_labels) num_of_bounds = num_of_labels;
+    if ((size_t) num_of_bounds > max_bounds) num_of_bounds = max_bounds;
+    if (num_of_bounds < 1) num_of_bounds = 1;
+    p_tr->num_of_bounds = num_of_bounds;
+    if (num_of_bounds >= num_of_labels) 
+      VPRINTF("Use Elkan's bounds: %d lower bounds per object\n", num_of_bounds);
+    else if (num_of_bounds == 1) 
+      VPRINTF("Use Hamerly's bounds: one lower bound per object\n");
+    else 
+      VPRINTF("Use Yinyang's bounds: %d lower bounds per object for groups of centroids\n", num_of_bounds);
+    if (num_of_bounds < num_of_labels && max_bounds < (size_t) num_of_labels) 
+      VPRINTF("\t(Elkan's bounds take %.1f MB, over the budget of %.1f MB by --bound_budget)\n",
+	      (double) (size * num_of_labels * sizeof(SCALAR)) / (1 << 20), (double) d2_bound_budget / (1 << 20));
+
+    p_tr->group = NULL;
+    if (num_of_bounds > 1 && num_of_bounds < num_of_labels) {
+      /* groups are formed from the initial centroids, see d2_labeling_prep() */
+      p_tr->group = _D2_MALLOC_INT(num_of_labels);
+      for (j=0; j<(size_t) num_of_labels; ++j) p_tr->group[j] = -1;
+    }
+    p_tr->l = _D2_MALLOC_SCALAR(size * p_tr->num_of_bounds);
     p_tr->u = _D2_MALLOC_SCALAR(size);
     p_tr->s = _D2_MALLOC_SCALAR(num_of_labels);
-    p_tr->c = _D2_MALLOC_SCALAR(num_of_labels * num_of_labels);
+    p_tr->c = _D2_CALLOC_SCALAR(num_of_labels * num_of_labels);
+    p_tr->drift = _D2_MALLOC_SCALAR(num_of_labels);
+    for (j=0; j<(size_t) num_of_labels; ++j) p_tr->drift[j] = -1;
     p_tr->r = (char *) calloc(size, sizeof(char));
 
-    for (j=0; j<size * num_of_labels; ++j) p_tr->l[j] = 0;
+    for (j=0; j<size * p_tr->num_of_bounds; ++j) p_tr->l[j] = 0;
     for (j=0; j<size; ++j) {p_tr->u[j] = DBL_MAX; p_tr->r[j] = 1; }
   }
   return 0;
@@ -241,6 +328,9 @@ int d2_free_work(var_mph *var_work, int selected_phase) {
     if (var_work->g_var[i].C) _D2_FREE(var_work->g_var[i].C);
     if (var_work->g_var[i].X) _D2_FREE(var_work->g_var[i].X);
     if (var_work->g_var[i].L) _D2_FREE(var_work->g_var[i].L);
+    if (var_work->g_var[i].C_batch) _D2_FREE(var_work->g_var[i].C_batch);
+    if (var_work->g_var[i].batch) free(var_work->g_var[i].batch);
+    if (var_work->g_var[i].mean) _D2_FREE(var_work->g_var[i].mean);
 
     if (d2_alg_type == D2_CENTROID_BADMM) {
       d2_free_work_sphBregman(var_work->l_var_sphBregman + i);
@@ -250,11 +340,117 @@ int d2_free_work(var_mph *var_work, int selected_phase) {
   if (var_work->g_var) free(var_work->g_var);
   if (d2_alg_type == D2_CENTROID_BADMM) free(var_work->l_var_sphBregman);
   if (var_work->label_switch) free(var_work->label_switch);
+  if (var_work->batch) free(var_work->batch);
+  if (var_work->batch_idx) _D2_FREE(var_work->batch_idx);
+  if (var_work->batch_val) free(var_work->batch_val);
+  if (var_work->batch_dist) free(var_work->batch_dist);
+  if (var_work->solver_ctx) {
+    for (i=0; i<var_work->num_of_threads; ++i) d2_solver_context_free(var_work->solver_ctx[i]);
+    free(var_work->solver_ctx);
+  }
   if (p_tr->l) _D2_FREE(p_tr->l);
   if (p_tr->u) _D2_FREE(p_tr->u);
   if (p_tr->s) _D2_FREE(p_tr->s);
   if (p_tr->c) _D2_FREE(p_tr->c);
   if (p_tr->r) free(p_tr->r);
+  if (p_tr->group) _D2_FREE(p_tr->group);
+  if (p_tr->drift) _D2_FREE(p_tr->drift);
   return 0;
 }
 
+/**
+ * Compute the weighted mean of supports of each d2 in a phase, where
+ * symbolic supports (D2_WORD_EMBED) are looked up in vocab_vec.
+ */
+void d2_compute_means(sph *p_sph, size_t size, __OUT__ SCALAR *mean) {
+  const int dim = p_sph->dim;
+  size_t i, k;
+  int d;
+  for (i=0; i<size; ++i) {
+    SCALAR *mu = mean + i*dim, sw = 0;
+    for (d=0; d<dim; ++d) mu[d] = 0;
+    for (k=p_sph->p_str_cum[i]; k<p_sph->p_str_cum[i] + p_sph->p_str[i]; ++k) {
+      SCALAR w = p_sph->p_w[k];
+      const SCALAR *supp;
+      sw += w;
+      if (p_sph->p_supp) supp = p_sph->p_supp + k*dim;
+      else if (p_sph->p_supp_sym[k] >= 0) supp = p_sph->vocab_vec + p_sph->p_supp_sym[k]*dim;
+      else continue; // zero vector
+      for (d=0; d<dim; ++d) mu[d] += w * supp[d];
+    }
+    if (sw > 0) for (d=0; d<dim; ++d) mu[d] /= sw;
+  }
+}
+
+typedef struct {SCALAR x, w; int k;} support_1d;
+
+static int compare_support_1d(const void *a, const void *b) {
+  const support_1d *sa = (const support_1d *) a, *sb = (const support_1d *) b;
+  if (sa->x != sb->x) return sa->x < sb->x ? -1 : 1;
+  return sa->k - sb->k;
+}
+
+/**
+ * Sort supports on a line ascendingly together with their weights, and
+ * return whether they were already in order. When @param(perm) is given,
+ * perm[k] is set to the index before sorting of the k-th support.
+ */
+char d2_sort_supports_1d(int n, SCALAR *supp, SCALAR *w, __OUT__ int *perm) {
+  support_1d *s;
+  int k;
+
+  for (k=1; k<n && supp[k-1] <= supp[k]; ++k);
+  if (k >= n) {
+    if (perm) for (k=0; k<n; ++k) perm[k] = k;
+    return true;
+  }
+
+  s = (support_1d *) malloc(n * sizeof(support_1d));
+  for (k=0; k<n; ++k) {s[k].x = supp[k]; s[k].w = w[k]; s[k].k = k;}
+  qsort(s, n, sizeof(support_1d), compare_support_1d);
+  for (k=0; k<n; ++k) {
+    supp[k] = s[k].x; w[k] = s[k].w;
+    if (perm) perm[k] = s[k].k;
+  }
+  free(s);
+  return false;
+}
+
+d2_solver_context* d2_get_solver_context(var_mph *var_work) {
+#ifdef _OPENMP
+  if (var_work->num_of_threads > 1) return var_work->solver_ctx[omp_get_thread_num()];
+#endif
+  return var_work->solver_ctx[0];
+}
+
+/**
+ * Make the view of var_work for the calling thread in a parallel region,
+ * which owns the batch spaces and the solver context of the thread, so
+ * that each thread can compute batches of distances on its own view.
+ * @param(g_var) is the space for the s_ph phases of the view.
+ */
+void d2_thread_work(var_mph *var_work, int selected_phase,
+		    var_sph *g_var, __OUT__ var_mph *thread_work) {
+  int n, t = 0;
+  size_t b = var_work->batch_size, k = var_work->num_of_labels;
+#ifdef _OPENMP
+  t = omp_get_thread_num();
+#endif
+  assert(t < var_work->num_of_threads);
+
+  *thread_work = *var_work;
+  thread_work->num_of_threads = 1;
+  thread_work->solver_ctx = var_work->solver_ctx + t;
+  thread_work->batch = var_work->batch + t*b;
+  thread_work->batch_idx = var_work->batch_idx + t*k;
+  thread_work->batch_val = var_work->batch_val + t*2*b;
+  thread_work->batch_dist = var_work->batch_dist + t*3*k;
+
+  thread_work->g_var = g_var;
+  for (n=0; n<var_work->s_ph; ++n)
+    if (selected_phase < 0 || n == selected_phase) {
+      g_var[n] = var_work->g_var[n];
+      g_var[n].batch = var_work->g_var[n].batch + t*b;
+      if (g_var[n].C_batch) g_var[n].C_batch += t*b*var_work->g_var[n].batch_stride;
+    }
+}
@@ -0,0 +1,51 @@
+#include "d2/solver.h"
+#include <stdlib.h>
+#include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* order problems by their shapes (n, m) */
+static int compare_shape(const void *a, const void *b) {
+  const d2_match_problem *pa = *(const d2_match_problem * const *) a;
+  const d2_match_problem *pb = *(const d2_match_problem * const *) b;
+  if (pa->n != pb->n) return pa->n < pb->n ? -1 : 1;
+  if (pa->m != pb->m) return pa->m < pb->m ? -1 : 1;
+  return pa < pb ? -1 : (pa > pb);
+}
+
+/**
+ * Problems are sorted by shapes so that a context keeps solving problems
+ * of the same size in a row, which reuses its cached task (MOSEK) or its
+ * working arrays (network simplex). Contiguous blocks of the sorted
+ * problems are then assigned to threads.
+ */
+void d2_match_by_distmat_batch(d2_solver_context **ctx, int num_of_ctx,
+			       size_t count, d2_match_problem *problems,
+			       __OUT__ double *fval) {
+  d2_match_problem **sorted;
+  long k;
+
+  assert(num_of_ctx > 0);
+  if (count == 0) return;
+
+  sorted = (d2_match_problem **) malloc(count * sizeof(d2_match_problem *));
+  for (k=0; k<(long) count; ++k) sorted[k] = problems + k;
+  qsort(sorted, count, sizeof(d2_match_problem *), compare_shape);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(num_of_ctx)
+#endif
+  for (k=0; k<(long) count; ++k) {
+    d2_match_problem *p = sorted[k];
+#ifdef _OPENMP
+    d2_solver_context *c = ctx[omp_get_thread_num()];
+#else
+    d2_solver_context *c = ctx[0];
+#endif
+    fval[p - problems] = d2_match_by_distmat_ctx(c, p->n, p->m, p->C, p->wX, p->wY,
+						 NULL, NULL, p->index);
+  }
+
+  free(sorted);
+}
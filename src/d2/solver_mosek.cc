@@ -9,10 +9,26 @@ static MSKenv_t   env = NULL;
 
 #include <utility>  
 #include <map>
+#include <vector>
+#include "utils/lru_cache.hh"
 using std::pair;
 using std::make_pair;
 using std::map;
-static map< pair<int, int>, MSKtask_t > task_mapper;
+using std::vector;
+
+/* status keys of an optimal basis, to warm start the next solve of the same index */
+typedef struct {
+  int n, m;
+  vector<MSKstakeye> skc, skx;
+} mosek_basis;
+
+/* tasks are cached by the size of problems, one cache per context */
+struct d2_solver_context {
+  map< pair<int, int>, MSKtask_t > task_mapper;
+  lru_cache<size_t, mosek_basis> bases;
+};
+
+static d2_solver_context default_context;
 
 /* This function prints log output from MOSEK to the terminal. */
 static void MSKAPI printstr(void *handle,
@@ -53,28 +69,51 @@ void d2_solver_release() {
   for (i=0; i<task_seq_size; ++i) 
     if (task_seq[i] != NULL) MSK_deletetask(&task_seq [i]);
   */
-  for (map< pair<int, int>, MSKtask_t >::iterator it=task_mapper.begin(); it!=task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  for (map< pair<int, int>, MSKtask_t >::iterator it=default_context.task_mapper.begin(); it!=default_context.task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  default_context.task_mapper.clear();
+  default_context.bases.clear();
   MSK_deleteenv(&env);
 }
 
+/* the environment is shared, so contexts should be freed before d2_solver_release() */
+d2_solver_context* d2_solver_context_create() {
+  return new d2_solver_context;
+}
+
+void d2_solver_context_free(d2_solver_context *ctx) {
+  for (map< pair<int, int>, MSKtask_t >::iterator it=ctx->task_mapper.begin(); it!=ctx->task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  delete ctx;
+}
+
+void d2_solver_context_warmstart(d2_solver_context *ctx, size_t capacity) {
+  ctx->bases.set_capacity(capacity);
+}
 
 double d2_match_by_distmat(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
 			   __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
+  return d2_match_by_distmat_ctx(&default_context, n, m, C, wX, wY, x, lambda, index);
+}
+
+
+double d2_match_by_distmat_ctx(d2_solver_context *ctx,
+			       int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			       __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
   
   const MSKint32t numvar = n * m,
                   numcon = n + m - 1;
   MSKtask_t    *p_task;
   MSKrescodee r = MSK_RES_OK;
   MSKint32t    i,j;
-  double fval = 0.0;
+  double fval = D2_SOLVER_ERROR; // unless the solution is (near) optimal
+  mosek_basis *basis = ctx->bases.insert(index);
 
   /* check if it is in the mode of multiple phase or single phase */
   //  p_task = &task_seq[index];
 
-  if (task_mapper.find(make_pair (n, m)) == task_mapper.end()) {
-    task_mapper[make_pair (n, m)] = NULL;
+  if (ctx->task_mapper.find(make_pair (n, m)) == ctx->task_mapper.end()) {
+    ctx->task_mapper[make_pair (n, m)] = NULL;
   }
-  p_task = &task_mapper[make_pair (n, m)];
+  p_task = &ctx->task_mapper[make_pair (n, m)];
 
   if (*p_task == NULL) {
   MSKint32t *asub;
@@ -143,6 +182,15 @@ double d2_match_by_distmat(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
 			wY[i]);
 
 
+  /* hot-start the simplex from the basis of the last solve of this index */
+  if (basis && (basis->n != n || basis->m != m)) {
+    basis->n = n; basis->m = m; basis->skc.clear(); basis->skx.clear();
+  }
+  if (basis && !basis->skc.empty() && r==MSK_RES_OK) {
+    r = MSK_putskc(*p_task, MSK_SOL_BAS, &basis->skc[0]);
+    if (r==MSK_RES_OK) r = MSK_putskx(*p_task, MSK_SOL_BAS, &basis->skx[0]);
+  }
+
   if ( r==MSK_RES_OK )
     {
       MSKrescodee trmcode;
@@ -165,6 +213,11 @@ double d2_match_by_distmat(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
           {
             //double *xx = (double*) calloc(numvar,sizeof(double));
 	    MSK_getprimalobj(*p_task, MSK_SOL_BAS, &fval);
+	    if (basis) {
+	      basis->skc.resize(numcon); basis->skx.resize(numvar);
+	      MSK_getskc(*p_task, MSK_SOL_BAS, &basis->skc[0]);
+	      MSK_getskx(*p_task, MSK_SOL_BAS, &basis->skx[0]);
+	    }
             if ( x )
             {
 #ifdef _D2_DOUBLE
@@ -241,7 +294,7 @@ double d2_match_by_distmat_qp(int n, int m,
   MSKtask_t task = NULL;
   MSKrescodee r;
   MSKint32t i, j;
-  double fval = 0.0, ones[] = {1.0, 1.0};
+  double fval = D2_SOLVER_ERROR, ones[] = {1.0, 1.0}; // fval unless the solution is (near) optimal
   MSKint32t *asub = (MSKint32t *) malloc(2*m*n*sizeof(MSKint32t));
   MSKint32t *bsub = (MSKint32t *) malloc(n*sizeof(MSKint32t));
   MSKint32t *qsub = (MSKint32t *) malloc(n*sizeof(MSKint32t));
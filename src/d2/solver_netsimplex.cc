@@ -0,0 +1,414 @@
+#include "d2/solver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "utils/blas_util.h"
+
+/**
+ * A license-free replacement of solver_mosek.cc: the transportation
+ * problem behind d2_match_by_distmat() is solved by a primal network
+ * simplex method specialized to the complete bipartite graph.
+ *
+ *   min  sum_{i,j} C[i + j*n] x[i + j*n]
+ *   s.t. sum_j x[i + j*n] = wX[i],   i = 0, ..., n-1
+ *        sum_i x[i + j*n] = wY[j],   j = 0, ..., m-2
+ *        x >= 0
+ *
+ * As in solver_mosek.cc, the constraint of the last column is dropped,
+ * so that tiny imbalance between wX and wY is absorbed there and the
+ * dual variables returned in lambda (of length n+m-1) are normalized
+ * by fixing the dual of the last column to zero.
+ */
+
+#include <vector>
+#include <algorithm>
+#include "utils/lru_cache.hh"
+using std::vector;
+
+/* working space of the solver, re-used across calls */
+typedef struct {
+  vector<int> cell;      /* basic cells (i + j*n), n+m-1 of them */
+  vector<double> xb;     /* primal values of basic cells */
+  vector<int> adj_head;  /* node adjacency in the basis tree (CSR) */
+  vector<int> adj;
+  vector<int> parent, parent_edge, depth, queue;
+  vector<int> first_child, next_sibling, prev_sibling;
+  vector<double> pi;     /* node potentials: rows [0,n), columns [n,n+m) */
+  vector<double> s, d;
+  vector<int> se, de;    /* multiples of the perturbation of s and d, see init_basis() */
+  vector<char> alive;
+  vector<int> order;
+} netsimplex_work;
+
+/* an optimal basis kept to warm start the next solve of the same index */
+typedef struct {
+  int n, m;
+  vector<int> cell;
+} netsimplex_basis;
+
+struct d2_solver_context {
+  netsimplex_work work;
+  lru_cache<size_t, netsimplex_basis> bases;
+};
+
+static d2_solver_context default_context;
+
+/* strictly negative reduced cost smaller than this is a candidate to enter */
+#define NETSIMPLEX_TOL (1E-12)
+
+struct cost_less {
+  const SCALAR *C;
+  cost_less(const SCALAR *C): C(C) {}
+  bool operator()(int a, int b) const {return C[a] < C[b];}
+};
+
+/* a + ae * eps <= b + be * eps for an infinitesimal eps > 0 */
+static inline bool lex_le(double a, int ae, double b, int be) {
+  return a < b || (a == b && ae <= be);
+}
+
+/**
+ * Initial basic feasible solution by the matrix minimum rule:
+ * visit cells by increasing cost and each allocation closes exactly
+ * one row or one column (the last one closes both), which gives a
+ * spanning tree of n+m-1 basic cells, possibly degenerate.
+ *
+ * Ties are broken as if every row supplied eps more and every column
+ * but the last one (the root, see build_tree()) of positive weight
+ * demanded eps less, so that the tree is strongly feasible: every
+ * cell on the path from a column to the root that is used against
+ * its direction carries positive flow. netsimplex() keeps it so,
+ * which rules out cycling on degenerate pivots.
+ */
+static void init_basis(netsimplex_work *w, int n, int m, const SCALAR *C,
+		       const SCALAR *wX, const SCALAR *wY) {
+  int i, j, k, rows_left = n, cols_left = m;
+  double sum = 0;
+
+  w->s.resize(n); w->d.resize(m); w->alive.assign(n+m, 1);
+  w->se.assign(n, 1); w->de.assign(m, 0);
+  for (i=0; i<n; ++i) {w->s[i] = wX[i]; sum += wX[i];}
+  for (j=0; j<m-1; ++j) {w->d[j] = wY[j]; sum -= wY[j];}
+  w->d[m-1] = sum > 0 ? sum : 0; // the last column absorbs the imbalance
+  w->de[m-1] = n;
+  for (j=0; j<m-1; ++j) if (w->d[j] > 0) {w->de[j] = -1; ++w->de[m-1];}
+
+  w->order.resize(n*m);
+  for (k=0; k<n*m; ++k) w->order[k] = k;
+  std::sort(w->order.begin(), w->order.end(), cost_less(C));
+
+  w->cell.clear(); w->xb.clear();
+  for (k=0; k<n*m; ++k) {
+    int c = w->order[k], ve;
+    double val;
+    i = c % n; j = c / n;
+    if (!w->alive[i] || !w->alive[n+j]) continue;
+
+    if (rows_left == 1 && cols_left == 1) {
+      w->cell.push_back(c); w->xb.push_back(w->s[i] > 0 ? w->s[i] : 0);
+      break;
+    }
+    if (lex_le(w->s[i], w->se[i], w->d[j], w->de[j])) {val = w->s[i]; ve = w->se[i];}
+    else {val = w->d[j]; ve = w->de[j];}
+    w->cell.push_back(c); w->xb.push_back(val > 0 ? val : 0);
+    w->s[i] -= val; w->se[i] -= ve;
+    w->d[j] -= val; w->de[j] -= ve;
+    if (cols_left == 1 || (rows_left > 1 && lex_le(w->s[i], w->se[i], w->d[j], w->de[j]))) {
+      w->alive[i] = 0; --rows_left;
+    } else {
+      w->alive[n+j] = 0; --cols_left;
+    }
+  }
+}
+
+/* remove node v from the children of its parent */
+static inline void tree_detach(netsimplex_work *w, int v) {
+  if (w->prev_sibling[v] >= 0) w->next_sibling[w->prev_sibling[v]] = w->next_sibling[v];
+  else w->first_child[w->parent[v]] = w->next_sibling[v];
+  if (w->next_sibling[v] >= 0) w->prev_sibling[w->next_sibling[v]] = w->prev_sibling[v];
+}
+
+/* add node v to the children of node u through the basic cell of slot e */
+static inline void tree_attach(netsimplex_work *w, int v, int u, int e) {
+  w->parent[v] = u; w->parent_edge[v] = e;
+  w->prev_sibling[v] = -1; w->next_sibling[v] = w->first_child[u];
+  if (w->first_child[u] >= 0) w->prev_sibling[w->first_child[u]] = v;
+  w->first_child[u] = v;
+}
+
+/**
+ * Root the basis tree at the last column and compute the potentials
+ * such that C[i + j*n] = pi[i] + pi[n+j] holds on every basic cell.
+ * Nodes are left in w->queue in breadth-first order.
+ */
+static void build_tree(netsimplex_work *w, int n, int m, const SCALAR *C) {
+  const int num_of_nodes = n + m, num_of_cells = n + m - 1;
+  int k, head, tail;
+
+  w->adj_head.assign(num_of_nodes + 1, 0);
+  w->adj.resize(2*num_of_cells);
+  for (k=0; k<num_of_cells; ++k) {
+    ++w->adj_head[w->cell[k] % n + 1];
+    ++w->adj_head[n + w->cell[k] / n + 1];
+  }
+  for (k=0; k<num_of_nodes; ++k) w->adj_head[k+1] += w->adj_head[k];
+  w->queue.assign(w->adj_head.begin(), w->adj_head.end() - 1); // fill pointers
+  for (k=0; k<num_of_cells; ++k) {
+    w->adj[w->queue[w->cell[k] % n]++] = k;
+    w->adj[w->queue[n + w->cell[k] / n]++] = k;
+  }
+
+  w->parent.assign(num_of_nodes, -1);
+  w->parent_edge.assign(num_of_nodes, -1);
+  w->depth.assign(num_of_nodes, -1);
+  w->first_child.assign(num_of_nodes, -1);
+  w->next_sibling.resize(num_of_nodes);
+  w->prev_sibling.resize(num_of_nodes);
+  w->pi.resize(num_of_nodes);
+
+  head = 0; tail = 0;
+  w->queue[tail++] = num_of_nodes - 1;
+  w->depth[num_of_nodes - 1] = 0; w->pi[num_of_nodes - 1] = 0;
+  while (head < tail) {
+    int u = w->queue[head++];
+    for (k=w->adj_head[u]; k<w->adj_head[u+1]; ++k) {
+      int e = w->adj[k], c = w->cell[e];
+      int v = (u < n) ? n + c / n : c % n;
+      if (w->depth[v] >= 0) continue;
+      w->depth[v] = w->depth[u] + 1;
+      tree_attach(w, v, u, e);
+      w->pi[v] = C[c] - w->pi[u];
+      w->queue[tail++] = v;
+    }
+  }
+}
+
+/**
+ * Start from a basis of a previous solve: the flows on the tree are
+ * determined by the new weights, obtained by pruning leaves bottom-up.
+ * Return false if the basis is not strongly feasible (see init_basis())
+ * for the new weights.
+ */
+static bool warm_basis(netsimplex_work *w, int n, int m, const SCALAR *C,
+		       const SCALAR *wX, const SCALAR *wY,
+		       const netsimplex_basis *basis) {
+  const int num_of_nodes = n + m;
+  double sum = 0, tol;
+  int i, j, k;
+
+  w->cell = basis->cell;
+  w->xb.assign(n + m - 1, 0);
+  build_tree(w, n, m, C);
+
+  w->s.resize(num_of_nodes); // s now holds the imbalance of each node
+  for (i=0; i<n; ++i) {w->s[i] = wX[i]; sum += wX[i];}
+  for (j=0; j<m; ++j) w->s[n+j] = wY[j];
+  tol = 1E-9 * (sum > 0 ? sum : 1);
+
+  for (k=0; k<num_of_nodes; ++k) if (w->depth[k] < 0) return false; // not a spanning tree
+  for (k=num_of_nodes-1; k>0; --k) { // skip the root, which absorbs the imbalance
+    int v = w->queue[k], e = w->parent_edge[v];
+    if (w->s[v] < -tol) return false;
+    if (v >= n && w->s[v] <= tol && wY[v-n] > 0) return false; // degenerate against its direction
+    w->xb[e] = w->s[v] > 0 ? w->s[v] : 0;
+    w->s[w->parent[v]] -= w->s[v];
+  }
+  return true;
+}
+
+/**
+ * Primal network simplex with Dantzig's pricing. The leaving cell is
+ * chosen by Cunningham's rule, the last blocking cell of the cycle
+ * traversed from its apex along the entering cell, which keeps the
+ * tree strongly feasible. Each pivot re-roots the subtree cut off by
+ * the leaving cell and shifts the potentials of its nodes only.
+ * Return D2_SOLVER_ERROR if the maximum number of pivots is reached.
+ */
+static double netsimplex(netsimplex_work *w, int n, int m, const SCALAR *C,
+			 const SCALAR *wX, const SCALAR *wY,
+			 const netsimplex_basis *basis) {
+  const int num_of_cells = n + m - 1;
+  const int max_pivots = 10 * n * m + 100;
+  double cmax = 0, fval = 0;
+  int k, iter;
+
+  for (k=0; k<n*m; ++k) if (fabs(C[k]) > cmax) cmax = fabs(C[k]);
+
+  if (!basis || !warm_basis(w, n, m, C, wX, wY, basis)) {
+    init_basis(w, n, m, C, wX, wY);
+    build_tree(w, n, m, C);
+  }
+
+  for (iter=0; iter < max_pivots; ++iter) {
+    int p = -1, q = -1, a, b, v, apex, out = -1, x, y, e, top;
+    double rmin = -NETSIMPLEX_TOL * (1 + cmax), theta = HUGE_VAL, shift;
+
+    /* pricing: Dantzig's rule */
+    for (b=0; b<m; ++b) {
+      const SCALAR *Cb = C + b*n;
+      double vb = w->pi[n+b];
+      for (a=0; a<n; ++a) {
+	double r = Cb[a] - w->pi[a] - vb;
+	if (r < rmin) {rmin = r; p = a; q = b;}
+      }
+    }
+    if (p < 0) break; // optimal
+
+    /**
+     * The entering cell (p,q) closes a cycle with the tree paths from
+     * column q and row p up to their apex. Cells whose child is a column
+     * on the path of q, or a row on the path of p, lose theta, and the
+     * others gain theta.
+     */
+    a = p; b = n + q;
+    while (a != b) {
+      if (w->depth[b] >= w->depth[a]) b = w->parent[b]; else a = w->parent[a];
+    }
+    apex = a;
+    for (v=n+q; v!=apex; v=w->parent[v]) 
+      if (v >= n && w->xb[w->parent_edge[v]] < theta) theta = w->xb[w->parent_edge[v]];
+    for (v=p; v!=apex; v=w->parent[v]) 
+      if (v < n && w->xb[w->parent_edge[v]] < theta) theta = w->xb[w->parent_edge[v]];
+    for (v=n+q; v!=apex; v=w->parent[v]) 
+      if (v >= n && w->xb[w->parent_edge[v]] == theta) out = v; // the closest to the apex
+    if (out < 0) 
+      for (v=p; v!=apex; v=w->parent[v]) 
+	if (v < n && w->xb[w->parent_edge[v]] == theta) {out = v; break;} // the closest to p
+
+    for (v=n+q; v!=apex; v=w->parent[v]) w->xb[w->parent_edge[v]] += (v >= n) ? -theta : theta;
+    for (v=p; v!=apex; v=w->parent[v])   w->xb[w->parent_edge[v]] += (v < n)  ? -theta : theta;
+
+    /* the entering cell takes the slot of the leaving one, and the subtree of out hangs on it */
+    e = w->parent_edge[out];
+    w->cell[e] = p + q*n;
+    w->xb[e] = theta;
+    for (v=n+q; v!=apex && v!=out; v=w->parent[v]);
+    if (v == out) {x = n + q; y = p;} else {x = p; y = n + q;}
+
+    /* reverse the path from x up to out */
+    for (v=x, a=y; ; ) {
+      int u = w->parent[v], f = w->parent_edge[v];
+      tree_detach(w, v);
+      tree_attach(w, v, a, e);
+      if (v == out) break;
+      a = v; e = f; v = u;
+    }
+
+    /* C[p + q*n] = pi[p] + pi[n+q] holds by shifting the potentials of the subtree */
+    shift = x < n ? rmin : -rmin;
+    w->depth[x] = w->depth[y] + 1;
+    w->queue[0] = x; top = 1;
+    while (top > 0) {
+      int c;
+      v = w->queue[--top];
+      w->pi[v] += v < n ? shift : -shift;
+      for (c=w->first_child[v]; c>=0; c=w->next_sibling[c]) {
+	w->depth[c] = w->depth[v] + 1;
+	w->queue[top++] = c;
+      }
+    }
+  }
+
+  if (iter == max_pivots) return D2_SOLVER_ERROR;
+
+  for (k=0; k<num_of_cells; ++k) fval += C[w->cell[k]] * w->xb[k];
+  return fval;
+}
+
+void d2_solver_setup() {
+  return;
+}
+
+void d2_solver_release() {
+  netsimplex_work empty;
+  std::swap(default_context.work, empty);
+  default_context.bases.clear(); // bases of this run are stale in the next one
+}
+
+d2_solver_context* d2_solver_context_create() {
+  return new d2_solver_context;
+}
+
+void d2_solver_context_free(d2_solver_context *ctx) {
+  delete ctx;
+}
+
+void d2_solver_context_warmstart(d2_solver_context *ctx, size_t capacity) {
+  ctx->bases.set_capacity(capacity);
+}
+
+double d2_match_by_distmat_ctx(d2_solver_context *ctx,
+			       int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			       __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
+  netsimplex_work *w = &ctx->work;
+  netsimplex_basis *basis = ctx->bases.insert(index);
+  int i, k;
+  double fval;
+
+  if (basis && (basis->n != n || basis->m != m)) {
+    basis->n = n; basis->m = m; basis->cell.clear();
+  }
+  fval = netsimplex(w, n, m, C, wX, wY, basis && !basis->cell.empty() ? basis : NULL);
+  if (fval == D2_SOLVER_ERROR) {
+    if (basis) basis->cell.clear();
+    return fval;
+  }
+  if (basis) basis->cell = w->cell;
+
+  if (x) {
+    for (k=0; k<n*m; ++k) x[k] = 0;
+    for (k=0; k<n+m-1; ++k) x[w->cell[k]] = w->xb[k];
+  }
+
+  if (lambda) {
+    build_tree(w, n, m, C); // potentials of the final basis
+    for (i=0; i<n+m-1; ++i) lambda[i] = w->pi[i];
+  }
+
+  return fval;
+}
+
+double d2_match_by_distmat(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			   __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
+  return d2_match_by_distmat_ctx(&default_context, n, m, C, wX, wY, x, lambda, index);
+}
+
+
+
+/**
+ * Main codes ends and extra codes begins.
+ */
+
+double d2_match_by_distmat_qp(int /* n */, int /* m */,
+			      SCALAR * /* C */, SCALAR * /* L */, SCALAR /* rho */,
+			      SCALAR * /* lw */, SCALAR * /* rw */,
+			      SCALAR * /* x0 */,
+			      /** OUT **/ SCALAR * /* x */) {
+  return D2_SOLVER_ERROR; // not supported, please build with SOLVER=mosek
+}
+
+
+/**
+ * min_w count/2 * |w|^2 - <c, w>  s.t. sum(w) = 1, w >= 0,
+ * which is the Euclidean projection of c/count onto the simplex
+ */
+double d2_qpsimple(int n, int count, SCALAR *c, /** OUT **/ SCALAR *w) {
+  vector<double> u(c, c + n);
+  double cum = 0, tau = 0, fval = 0;
+  int j;
+
+  for (j=0; j<n; ++j) u[j] /= count;
+  std::sort(u.begin(), u.end());
+  for (j=n-1; j>=0; --j) {
+    cum += u[j];
+    if (u[j] - (cum - 1) / (n - j) > 0) tau = (cum - 1) / (n - j);
+  }
+
+  for (j=0; j<n; ++j) {
+    double wj = c[j] / count - tau;
+    if (wj < 0) wj = 0;
+    fval += 0.5 * count * wj * wj - c[j] * wj;
+    if (w) w[j] = wj;
+  }
+  return fval;
+}
@@ -0,0 +1,40 @@
+#include "d2/solver.h"
+#include <assert.h>
+#include <math.h>
+
+/**
+ * Transportation on a line under the ground cost |x - y|^p with p >= 1 is
+ * solved by the monotone plan, which matches the quantile functions of the
+ * two distributions. The plan is found by a merge of the cumulative weights
+ * in O(n + m), following the north-west corner rule. With p = 1 on bins,
+ * the cost is the L1 distance between the two cumulative distributions.
+ */
+double d2_match_by_quantile(int n, int m, const SCALAR *x, const SCALAR *y,
+			    const SCALAR *wX, const SCALAR *wY, int p) {
+  int i, j;
+  double cost = 0., rx, ry;
+
+  assert(n > 0 && m > 0 && p >= 1);
+
+  if (p == 1 && !x && !y) {
+    double cx = 0., cy = 0.;
+    for (i=0; i < (n > m ? n : m) - 1; ++i) {
+      if (i < n) cx += wX[i];
+      if (i < m) cy += wY[i];
+      cost += fabs(cx - cy);
+    }
+    return cost;
+  }
+
+  i = 0; j = 0; rx = wX[0]; ry = wY[0];
+  while (i < n && j < m) {
+    double mass = rx < ry ? rx : ry;
+    double gap = fabs((x ? x[i] : i) - (y ? y[j] : j));
+    if (mass > 0) cost += mass * (p == 1 ? gap : p == 2 ? gap * gap : pow(gap, p));
+    rx -= mass; ry -= mass;
+    // move on the side whose mass is used up, or the lighter one after round-off
+    if (rx <= ry) {if (++i < n) rx = wX[i];}
+    else          {if (++j < m) ry = wY[j];}
+  }
+  return cost;
+}
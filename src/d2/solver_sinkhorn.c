@@ -0,0 +1,136 @@
+#include "d2/solver.h"
+#include "utils/blas_util.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+/**
+ * Approximate transportation by entropic regularization:
+ *   min <C, x> - eps * H(x)  s.t.  sum_j x(i,j) = wX(i), sum_i x(i,j) = wY(j)
+ * where x(i,j) = x[i + j*n] follows the layout of d2_match_by_distmat()
+ * and eps = @param(reg) * mean(C). Sinkhorn iterations are carried out on
+ * the dual potentials (f, g) in the log domain, so that small eps does not
+ * underflow:
+ *   f(i) = eps*log(wX(i)) - eps*log sum_j exp((g(j) - C(i,j))/eps)
+ *   g(j) = eps*log(wY(j)) - eps*log sum_i exp((f(i) - C(i,j))/eps)
+ * Zero weights give -inf potentials, which simply switch off their bins,
+ * and nothing is transported if all weights of one side are zeros.
+ *
+ * The return value is the cost of the Sinkhorn plan after it is rounded
+ * onto the transportation polytope (Altschuler et al., NIPS 2017), hence
+ * an upper bound of the exact cost. A lower bound is written to
+ * @param(lower) from the c-transform of (f, g), which is dual feasible.
+ */
+double d2_match_by_sinkhorn(int n, int m, SCALAR *C, SCALAR *wX, SCALAR *wY,
+			    double reg, int max_iters, double tol,
+			    __OUT__ double *lower) {
+  int i, j, iter;
+  double eps, err, upper = 0., lo = 0., sum_err = 0.;
+  double *f, *g, *mx, *s, *P, *ea, *eb;
+
+  assert(n > 0 && m > 0 && reg > 0);
+
+  for (j=0; j<n*m; ++j) upper += C[j];
+  eps = reg * upper / (n*m); upper = 0.;
+  if (eps <= 0) {*lower = 0.; return 0.;}
+  /* without any mass on one side, all potentials of the other side are -inf */
+  for (i=0; i<n && !(wX[i] > 0); ++i);
+  for (j=0; j<m && !(wY[j] > 0); ++j);
+  if (i == n || j == m) {*lower = 0.; return 0.;}
+
+  f  = (double *) malloc((2*(n + m) + 2*(n > m ? n : m) + n*m) * sizeof(double));
+  g  = f + n;
+  mx = g + m; // of size max(n,m)
+  s  = mx + (n > m ? n : m);
+  ea = s + (n > m ? n : m);
+  eb = ea + n;
+  P  = eb + m;
+
+  for (i=0; i<n; ++i) f[i] = 0.;
+  for (j=0; j<m; ++j) g[j] = 0.;
+
+  for (iter=0; iter < max_iters; ++iter) {
+    /* update f: reduce over columns, with contiguous inner loops */
+    for (i=0; i<n; ++i) {mx[i] = -HUGE_VAL; s[i] = 0.;}
+    for (j=0; j<m; ++j) {
+      const SCALAR *Cj = C + j*n;
+      for (i=0; i<n; ++i) if (g[j] - Cj[i] > mx[i]) mx[i] = g[j] - Cj[i];
+    }
+    for (j=0; j<m; ++j) {
+      const SCALAR *Cj = C + j*n;
+      for (i=0; i<n; ++i) s[i] += exp((g[j] - Cj[i] - mx[i]) / eps);
+    }
+    for (i=0; i<n; ++i) f[i] = eps * log(wX[i]) - mx[i] - eps * log(s[i]);
+
+    /* update g */
+    for (j=0; j<m; ++j) {
+      const SCALAR *Cj = C + j*n;
+      double mxj = -HUGE_VAL, sj = 0.;
+      for (i=0; i<n; ++i) if (f[i] - Cj[i] > mxj) mxj = f[i] - Cj[i];
+      for (i=0; i<n; ++i) sj += exp((f[i] - Cj[i] - mxj) / eps);
+      g[j] = eps * log(wY[j]) - mxj - eps * log(sj);
+    }
+
+    /* column marginals are exact now; check row marginals */
+    if (iter % 10 == 9 || iter == max_iters - 1) {
+      for (i=0; i<n; ++i) s[i] = 0.;
+      for (j=0; j<m; ++j) {
+	const SCALAR *Cj = C + j*n;
+	for (i=0; i<n; ++i) s[i] += exp((f[i] + g[j] - Cj[i]) / eps);
+      }
+      for (i=0, err = 0.; i<n; ++i) err += fabs(s[i] - wX[i]);
+      if (err < tol) break;
+    }
+  }
+
+  /* round the plan onto the transportation polytope */
+  for (i=0; i<n; ++i) s[i] = 0.;
+  for (j=0; j<m; ++j) {
+    const SCALAR *Cj = C + j*n;
+    double *Pj = P + j*n;
+    for (i=0; i<n; ++i) {Pj[i] = exp((f[i] + g[j] - Cj[i]) / eps); s[i] += Pj[i];}
+  }
+  for (i=0; i<n; ++i) mx[i] = (s[i] > wX[i]) ? wX[i] / s[i] : 1.;
+  for (j=0; j<m; ++j) {
+    double *Pj = P + j*n, cj = 0.;
+    for (i=0; i<n; ++i) {Pj[i] *= mx[i]; cj += Pj[i];}
+    if (cj > wY[j]) {
+      for (i=0; i<n; ++i) Pj[i] *= wY[j] / cj;
+      cj = wY[j];
+    }
+    eb[j] = wY[j] - cj;
+  }
+  for (i=0; i<n; ++i) ea[i] = wX[i];
+  for (j=0; j<m; ++j) {
+    const SCALAR *Cj = C + j*n;
+    double *Pj = P + j*n;
+    for (i=0; i<n; ++i) {ea[i] -= Pj[i]; upper += Cj[i] * Pj[i];}
+  }
+  for (i=0; i<n; ++i) {if (ea[i] < 0) ea[i] = 0.; sum_err += ea[i];}
+  if (sum_err > 0) {
+    for (j=0; j<m; ++j) {
+      const SCALAR *Cj = C + j*n;
+      for (i=0; i<n; ++i) upper += Cj[i] * ea[i] * eb[j] / sum_err;
+    }
+  }
+
+  /* c-transform: g(j) = min_i C(i,j) - f(i), f(i) = min_j C(i,j) - g(j) */
+  for (j=0; j<m; ++j) {
+    const SCALAR *Cj = C + j*n;
+    g[j] = HUGE_VAL;
+    for (i=0; i<n; ++i) if (Cj[i] - f[i] < g[j]) g[j] = Cj[i] - f[i];
+    if (wY[j] > 0) lo += wY[j] * g[j];
+  }
+  for (i=0; i<n; ++i) f[i] = HUGE_VAL;
+  for (j=0; j<m; ++j) {
+    const SCALAR *Cj = C + j*n;
+    for (i=0; i<n; ++i) if (Cj[i] - g[j] < f[i]) f[i] = Cj[i] - g[j];
+  }
+  for (i=0; i<n; ++i) if (wX[i] > 0) lo += wX[i] * f[i];
+
+  free(f);
+
+  *lower = lo > 0 ? lo : 0.;
+  if (*lower > upper) *lower = upper; // only round-off
+  return upper;
+}
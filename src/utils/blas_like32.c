@@ -6,9 +6,41 @@
 #include "utils/blas_like.h"
 #include "utils/blas_util.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
-#ifdef _D2_SINGLE
+#if defined(_D2_SINGLE) || defined(_D2_MIXED)
+/**
+ * expf(x) by x = k ln2 + r with |r| <= ln2/2, and the Taylor polynomial of
+ * exp(r) to degree 7, which is within 2 ulp. x is clamped to the range of
+ * normal numbers, so that there are no branches and loops calling it are
+ * vectorized (given -fno-trapping-math, see Makefile).
+ */
+static inline float vexp(float x) {
+  const float magic = 12582912.f; /* 1.5 * 2^23 */
+  float t, k, r, p;
+  uint32_t bits;
+  x = x > 88.f ? 88.f : x;
+  x = x < -87.f ? -87.f : x;
+  t = x * 1.44269504f + magic; /* round x / ln2 to k in the low bits of t */
+  k = t - magic;
+  r = x - k * 0.693145751953125f;
+  r = r - k * 1.428606765330187e-06f;
+  p = 1.f/5040;
+  p = p * r + 1.f/720;
+  p = p * r + 1.f/120;
+  p = p * r + 1.f/24;
+  p = p * r + 1.f/6;
+  p = p * r + 1.f/2;
+  p = p * r + 1.f;
+  p = p * r + 1.f;
+  memcpy(&bits, &t, sizeof(bits));
+  bits = (bits + 127) << 23; /* 2^k */
+  memcpy(&t, &bits, sizeof(t));
+  return p * t;
+}
+
 void _sgzero(size_t n, float *a) {
   size_t i;
   for (i=0; i<n; ++i) assert(a[i] > 1E-10);
@@ -125,7 +157,7 @@ void _scnorm(size_t m, size_t n, float *a, float *sa) {
   bool isAllocated = true;
   if (!sa) {
     isAllocated = false;
-    sa = _D2_MALLOC_SCALAR(n);
+    sa = (float *) malloc((n) * sizeof(float));
   }    
   _scsum(m, n, a, sa);
   for (i=0; i<n; ++i) assert(sa[i] > 0);
@@ -142,7 +174,7 @@ void _srnorm(size_t m, size_t n, float *a, float *sa) {
   bool isAllocated = true;
   if (!sa) {
     isAllocated = false;
-    sa = _D2_MALLOC_SCALAR(m);
+    sa = (float *) malloc((m) * sizeof(float));
   }    
   _srsum(m, n, a, sa);
   for (i=0; i<m; ++i) assert(sa[i] > 0);
@@ -160,7 +192,7 @@ void _sccenter(size_t m, size_t n, float *a, float *sa) {
   bool isAllocated = true;
   if (!sa) {
     isAllocated = false;
-    sa = _D2_MALLOC_SCALAR(n);
+    sa = (float *) malloc((n) * sizeof(float));
   }    
   _scsum(m, n, a, sa);
   cblas_sscal(n, 1./m, sa, 1);
@@ -177,7 +209,7 @@ void _srcenter(size_t m, size_t n, float *a, float *sa) {
   bool isAllocated = true;
   if (!sa) {
     isAllocated = false;
-    sa = _D2_MALLOC_SCALAR(m);
+    sa = (float *) malloc((m) * sizeof(float));
   }    
   _srsum(m, n, a, sa);
   cblas_sscal(m, 1./n, sa, 1);
@@ -218,6 +250,43 @@ void _spdist2_sym(int d, size_t n, size_t m, float *A, int *Bi, float *C, const
 	  C[i*n + j] += (A[kj] - vocab[ki]) * (A[kj] - vocab[ki]);
 }
 
+/**
+ * Cost matrices of count problems that share the supports B (or rows Bi of
+ * vocab), see _spdist2_batch(). Supports of A are transposed and laid side
+ * by side, so that the inner loop runs over the supports of all problems.
+ * The sums are taken in the same order as _spdist2().
+ */
+static void pdist2_batch(int d, size_t n, size_t m, size_t count, float *const *A,
+			 const float *B, const int *Bi, float *C, size_t stride) {
+  size_t cn = count * n, i, j, k; int l;
+  float *At = (float *) malloc((d + 1) * cn * sizeof(float)), *t = At + d*cn;
+  assert(d>0 && n>0 && m>0 && At);
+
+  for (k=0; k<count; ++k)
+    for (j=0; j<n; ++j)
+      for (l=0; l<d; ++l) At[l*cn + k*n + j] = A[k][j*d + l];
+  for (i=0; i<m; ++i) {
+    const float *b = Bi ? (Bi[i] < 0 ? NULL : B + Bi[i]*d) : B + i*d;
+    for (j=0; j<cn; ++j) t[j] = 0;
+    for (l=0; l<d; ++l) {
+      const float bl = b ? b[l] : 0, *a = At + l*cn;
+      for (j=0; j<cn; ++j) t[j] += (a[j] - bl) * (a[j] - bl);
+    }
+    for (k=0; k<count; ++k) memcpy(C + k*stride + i*n, t + k*n, n * sizeof(float));
+  }
+  free(At);
+}
+
+void _spdist2_batch(int d, size_t n, size_t m, size_t count, float *const *A, float *B,
+		     float *C, size_t stride) {
+  pdist2_batch(d, n, m, count, A, B, NULL, C, stride);
+}
+
+void _spdist2_sym_batch(int d, size_t n, size_t m, size_t count, float *const *A, int *Bi,
+			 float *C, size_t stride, const float *vocab) {
+  pdist2_batch(d, n, m, count, A, vocab, Bi, C, stride);
+}
+
 void _spdist2_submat(size_t m, int *Bi, float *C,
 		     const int vocab_size, const float *dist_mat) {
   size_t i; int j;
@@ -241,9 +310,38 @@ void _spdist_symbolic(int d, size_t n, size_t m, int * A, int * B, float *C,
 }
 
 // inplace a -> exp(a)
+_D2_SIMD_CLONES
 void _sexp(size_t n, float *a) {
   size_t i;
-  for (i=0; i<n; ++i, ++a) *a = exp(*a);
+  for (i=0; i<n; ++i) a[i] = vexp(a[i]);
+}
+
+// x = z .* exp(-c-y) + eps; x(:,*) = x(:,*) / sum(x(:,*)) * b(*)
+_D2_SIMD_CLONES
+void _scexpnorm(size_t m, size_t n, const float *z, const float *c, const float *y, const float *b, float eps, float *x) {
+  size_t i, j;
+  for (i=0; i<m*n; ++i) x[i] = z[i] * vexp(- (c[i] + y[i])) + eps;
+  for (i=0; i<n; ++i, x += m) {
+    float s = 0;
+    for (j=0; j<m; ++j) s += x[j];
+    assert(s > 0);
+    s = b[i] / s;
+    for (j=0; j<m; ++j) x[j] *= s;
+  }
+}
+
+// z = x .* exp(y) + eps; sa(*) = sum(z(*,:)); z(*,:) = z(*,:) / sa(*) * b(*)
+_D2_SIMD_CLONES
+void _srexpnorm(size_t m, size_t n, const float *x, const float *y, const float *b, float eps, float *z, float *sa) {
+  size_t i, j;
+  float *pz;
+  for (i=0; i<m*n; ++i) z[i] = x[i] * vexp(y[i]) + eps;
+  for (j=0; j<m; ++j) sa[j] = 0;
+  for (i=0, pz=z; i<n; ++i, pz += m)
+    for (j=0; j<m; ++j) sa[j] += pz[j];
+  for (j=0; j<m; ++j) assert(sa[j] > 0);
+  for (i=0, pz=z; i<n; ++i, pz += m)
+    for (j=0; j<m; ++j) pz[j] = pz[j] / sa[j] * b[j];
 }
 
 #endif
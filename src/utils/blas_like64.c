@@ -6,9 +6,47 @@
 #include "utils/blas_like.h"
 #include "utils/blas_util.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #ifdef _D2_DOUBLE
+/**
+ * exp(x) by x = k ln2 + r with |r| <= ln2/2, and the Taylor polynomial of
+ * exp(r) to degree 13, which is within 2 ulp. x is clamped to the range of
+ * normal numbers, so that there are no branches and loops calling it are
+ * vectorized (given -fno-trapping-math, see Makefile).
+ */
+static inline double vexp(double x) {
+  const double magic = 6755399441055744.0; /* 1.5 * 2^52 */
+  double t, k, r, p;
+  uint64_t bits;
+  x = x > 709. ? 709. : x;
+  x = x < -708. ? -708. : x;
+  t = x * 1.4426950408889634 + magic; /* round x / ln2 to k in the low bits of t */
+  k = t - magic;
+  r = x - k * 6.93147180369123816490e-01;
+  r = r - k * 1.90821492927058770002e-10;
+  p = 1./6227020800;
+  p = p * r + 1./479001600;
+  p = p * r + 1./39916800;
+  p = p * r + 1./3628800;
+  p = p * r + 1./362880;
+  p = p * r + 1./40320;
+  p = p * r + 1./5040;
+  p = p * r + 1./720;
+  p = p * r + 1./120;
+  p = p * r + 1./24;
+  p = p * r + 1./6;
+  p = p * r + 1./2;
+  p = p * r + 1.;
+  p = p * r + 1.;
+  memcpy(&bits, &t, sizeof(bits));
+  bits = (bits + 1023) << 52; /* 2^k */
+  memcpy(&t, &bits, sizeof(t));
+  return p * t;
+}
+
 void _dgzero(size_t n, double *a) {
   size_t i;
   for (i=0; i<n; ++i) assert(a[i] > 1E-10);
@@ -219,6 +257,43 @@ void _dpdist2_sym(int d, size_t n, size_t m, double *A, int *Bi, double *C, cons
 	  C[i*n + j] += (A[kj] - vocab[ki]) * (A[kj] - vocab[ki]);
 }
 
+/**
+ * Cost matrices of count problems that share the supports B (or rows Bi of
+ * vocab), see _dpdist2_batch(). Supports of A are transposed and laid side
+ * by side, so that the inner loop runs over the supports of all problems.
+ * The sums are taken in the same order as _dpdist2().
+ */
+static void pdist2_batch(int d, size_t n, size_t m, size_t count, double *const *A,
+			 const double *B, const int *Bi, double *C, size_t stride) {
+  size_t cn = count * n, i, j, k; int l;
+  double *At = (double *) malloc((d + 1) * cn * sizeof(double)), *t = At + d*cn;
+  assert(d>0 && n>0 && m>0 && At);
+
+  for (k=0; k<count; ++k)
+    for (j=0; j<n; ++j)
+      for (l=0; l<d; ++l) At[l*cn + k*n + j] = A[k][j*d + l];
+  for (i=0; i<m; ++i) {
+    const double *b = Bi ? (Bi[i] < 0 ? NULL : B + Bi[i]*d) : B + i*d;
+    for (j=0; j<cn; ++j) t[j] = 0;
+    for (l=0; l<d; ++l) {
+      const double bl = b ? b[l] : 0, *a = At + l*cn;
+      for (j=0; j<cn; ++j) t[j] += (a[j] - bl) * (a[j] - bl);
+    }
+    for (k=0; k<count; ++k) memcpy(C + k*stride + i*n, t + k*n, n * sizeof(double));
+  }
+  free(At);
+}
+
+void _dpdist2_batch(int d, size_t n, size_t m, size_t count, double *const *A, double *B,
+		     double *C, size_t stride) {
+  pdist2_batch(d, n, m, count, A, B, NULL, C, stride);
+}
+
+void _dpdist2_sym_batch(int d, size_t n, size_t m, size_t count, double *const *A, int *Bi,
+			 double *C, size_t stride, const double *vocab) {
+  pdist2_batch(d, n, m, count, A, vocab, Bi, C, stride);
+}
+
 void _dpdist2_submat(size_t m, int *Bi, double *C,
 		     const int vocab_size, const double *dist_mat) {
   size_t i; int j;
@@ -242,9 +317,38 @@ void _dpdist_symbolic(int d, size_t n, size_t m, int * A, int * B, double *C,
 }
 
 // inplace a -> exp(a)
+_D2_SIMD_CLONES
 void _dexp(size_t n, double *a) {
   size_t i;
-  for (i=0; i<n; ++i, ++a) *a = exp(*a);
+  for (i=0; i<n; ++i) a[i] = vexp(a[i]);
+}
+
+// x = z .* exp(-c-y) + eps; x(:,*) = x(:,*) / sum(x(:,*)) * b(*)
+_D2_SIMD_CLONES
+void _dcexpnorm(size_t m, size_t n, const double *z, const double *c, const double *y, const double *b, double eps, double *x) {
+  size_t i, j;
+  for (i=0; i<m*n; ++i) x[i] = z[i] * vexp(- (c[i] + y[i])) + eps;
+  for (i=0; i<n; ++i, x += m) {
+    double s = 0;
+    for (j=0; j<m; ++j) s += x[j];
+    assert(s > 0);
+    s = b[i] / s;
+    for (j=0; j<m; ++j) x[j] *= s;
+  }
+}
+
+// z = x .* exp(y) + eps; sa(*) = sum(z(*,:)); z(*,:) = z(*,:) / sa(*) * b(*)
+_D2_SIMD_CLONES
+void _drexpnorm(size_t m, size_t n, const double *x, const double *y, const double *b, double eps, double *z, double *sa) {
+  size_t i, j;
+  double *pz;
+  for (i=0; i<m*n; ++i) z[i] = x[i] * vexp(y[i]) + eps;
+  for (j=0; j<m; ++j) sa[j] = 0;
+  for (i=0, pz=z; i<n; ++i, pz += m)
+    for (j=0; j<m; ++j) sa[j] += pz[j];
+  for (j=0; j<m; ++j) assert(sa[j] > 0);
+  for (i=0, pz=z; i<n; ++i, pz += m)
+    for (j=0; j<m; ++j) pz[j] = pz[j] / sa[j] * b[j];
 }
 
 #endif